@@ -0,0 +1,378 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "e20_machine.h"
+
+using namespace std;
+
+/*
+Notes:
+Runs one program on the reference interpreter and on a candidate engine,
+comparing the complete machine state every --checkpoint steps. A
+checkpoint saves just the two machines; the candidate's side tables are
+rebuilt only when one is restored. When a checkpoint disagrees, both runs
+are restored from the previous checkpoint and single-stepped to find the
+first instruction after which they differ, or, for the trace engine, which
+never enters a trace in a one-step run, the chunk is bisected with longer
+runs. With --paged both run on copy-on-write paged memory, so that a
+checkpoint copies page pointers instead of all of memory.
+With --reduce, the program image is then shrunk by delta debugging (words
+are zeroed, never removed, so addresses and branch targets stay put) to a
+minimal image that still makes the engines diverge.
+*/
+
+/*
+    The outcome of a differential run.
+*/
+struct CheckResult
+{
+    bool diverged = false;
+    size_t step = 0; // steps completed by both engines when the states first differed
+    uint16_t pc = 0; // reference pc before the divergent instruction
+    string detail; // which part of the state differs
+    size_t chunk = 1; // if more than 1, only the steps [step, step + chunk) are known to diverge, starting at pc
+};
+
+/*
+    Starts run on image, on its engine.
+*/
+template <class M>
+void start_run(BasicEngineRun<M>& run, const uint16_t image[])
+{
+    run.machine.reset();
+    run.machine.load_image(image);
+    run.prepare();
+}
+
+/*
+    Restores a run to a checkpoint that saved only its machine. Side tables
+    that follow from memory (the predecoded instructions) are rebuilt from
+    it; a trace cache cannot be, so a trace run is instead replayed from
+    image in the same checkpoint-sized slices, which leaves it exactly as
+    it was.
+
+    @param done Steps the run had completed at the checkpoint
+*/
+template <class M>
+void restore_run(BasicEngineRun<M>& run, const M& saved, const uint16_t image[], size_t checkpoint, size_t done)
+{
+    if (run.engine != ENGINE_TRACE)
+    {
+        run.machine = saved;
+        run.prepare();
+        return;
+    }
+    start_run(run, image);
+    for (size_t replayed = 0; replayed < done; replayed += checkpoint)
+        run.run(checkpoint);
+}
+
+/*
+    Narrows a divergence within the chunk steps after runs' state down to
+    one step by bisection, rerunning both from a copy of that state for
+    half as many steps each time. Used for the trace engine, whose traces
+    only run when a slice has room for a whole loop iteration.
+
+    @param runs Reference and candidate at the last agreeing checkpoint,
+        which diverge after chunk steps
+    @param done Steps completed at that checkpoint
+*/
+template <class M>
+void bisect_chunk(const vector<BasicEngineRun<M>>& runs, size_t chunk, size_t done, CheckResult& result)
+{
+    vector<BasicEngineRun<M>> trial;
+    size_t agree = 0; // known to agree after this many steps
+    size_t differ = chunk; // known to differ after this many
+    while (differ - agree > 1)
+    {
+        size_t mid = agree + (differ - agree) / 2;
+        trial = runs;
+        size_t reference_steps = trial[0].run(mid);
+        size_t candidate_steps = trial[1].run(mid);
+        if (compare_runs(trial[0], reference_steps, trial[1], candidate_steps).empty())
+            agree = mid;
+        else
+            differ = mid;
+    }
+    trial = runs;
+    trial[0].run(agree);
+    result.pc = trial[0].machine.pc;
+    trial = runs;
+    size_t reference_steps = trial[0].run(differ);
+    size_t candidate_steps = trial[1].run(differ);
+    result.step = done + agree;
+    result.detail = compare_runs(trial[0], reference_steps, trial[1], candidate_steps);
+    result.chunk = 1;
+}
+
+/*
+    Runs image on the reference interpreter and on candidate, comparing
+    every checkpoint steps, for at most max_steps steps.
+
+    @param locate If true, narrow a divergence down to a single step
+*/
+template <class M>
+CheckResult check_image(const uint16_t image[], Engine candidate, size_t checkpoint, size_t max_steps, bool locate)
+{
+    vector<BasicEngineRun<M>> runs(2); // reference and candidate
+    vector<M> saved(2); // their machines at the last agreeing checkpoint
+    runs[0].engine = ENGINE_REFERENCE;
+    runs[1].engine = candidate;
+    for (size_t i = 0; i < 2; i++)
+        start_run(runs[i], image);
+
+    CheckResult result;
+    size_t done = 0;
+    while (done < max_steps && runs[0].machine.status == STATUS_RUNNING)
+    {
+        saved[0] = runs[0].machine;
+        saved[1] = runs[1].machine;
+        size_t chunk = min(checkpoint, max_steps - done);
+        size_t reference_steps = runs[0].run(chunk);
+        size_t candidate_steps = runs[1].run(chunk);
+        string detail = compare_runs(runs[0], reference_steps, runs[1], candidate_steps);
+        if (detail.empty())
+        {
+            done += reference_steps;
+            continue;
+        }
+
+        result.diverged = true;
+        result.step = done;
+        result.pc = saved[0].pc;
+        result.detail = detail;
+        result.chunk = chunk;
+        if (!locate || chunk == 1)
+            return result;
+
+        // go back to the last good checkpoint
+        restore_run(runs[0], saved[0], image, checkpoint, done);
+        restore_run(runs[1], saved[1], image, checkpoint, done);
+        if (candidate == ENGINE_TRACE)
+        {
+            bisect_chunk(runs, chunk, done, result);
+            return result;
+        }
+
+        // replay the failing chunk one step at a time
+        for (size_t i = 0; i < chunk; i++)
+        {
+            uint16_t pc = runs[0].machine.pc;
+            reference_steps = runs[0].run(1);
+            candidate_steps = runs[1].run(1);
+            detail = compare_runs(runs[0], reference_steps, runs[1], candidate_steps);
+            if (!detail.empty())
+            {
+                result.step = done + i;
+                result.pc = pc;
+                result.detail = detail;
+                result.chunk = 1;
+                return result;
+            }
+        }
+        // the chunk diverged but no single step does, so report the whole chunk
+        return result;
+    }
+    return result;
+}
+
+/*
+    Delta debugging (ddmin) over the non-zero words of image: repeatedly
+    zeroes subsets of them, keeping any change after which the engines
+    still diverge, until no single remaining word can be zeroed.
+
+    @return The number of non-zero words left
+*/
+template <class M>
+size_t reduce_image(uint16_t image[], Engine candidate, size_t max_steps)
+{
+    vector<size_t> kept; // addresses of the words still in the image
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+    {
+        if (image[addr] != 0)
+            kept.push_back(addr);
+    }
+    vector<uint16_t> original(image, image + MEM_SIZE);
+    vector<uint16_t> trial(MEM_SIZE);
+
+    // @return true if the image holding just the words in subset still diverges
+    auto still_diverges = [&](const vector<size_t>& subset) {
+        fill(trial.begin(), trial.end(), 0);
+        for (size_t i = 0; i < subset.size(); i++)
+            trial[subset[i]] = original[subset[i]];
+        return check_image<M>(trial.data(), candidate, max_steps, max_steps, false).diverged;
+    };
+
+    size_t granularity = 2;
+    while (kept.size() >= 2)
+    {
+        size_t chunk = (kept.size() + granularity - 1) / granularity;
+        bool reduced = false;
+        for (size_t start = 0; start < kept.size() && !reduced; start += chunk) // try keeping just one chunk
+        {
+            vector<size_t> subset(kept.begin() + start, kept.begin() + min(start + chunk, kept.size()));
+            if (still_diverges(subset))
+            {
+                kept = subset;
+                granularity = 2;
+                reduced = true;
+            }
+        }
+        for (size_t start = 0; start < kept.size() && !reduced; start += chunk) // try dropping one chunk
+        {
+            vector<size_t> complement(kept.begin(), kept.begin() + start);
+            complement.insert(complement.end(), kept.begin() + min(start + chunk, kept.size()), kept.end());
+            if (still_diverges(complement))
+            {
+                kept = complement;
+                granularity = max(granularity - 1, (size_t)2);
+                reduced = true;
+            }
+        }
+        if (!reduced)
+        {
+            if (granularity >= kept.size())
+                break;
+            granularity = min(granularity * 2, kept.size());
+        }
+    }
+
+    fill(image, image + MEM_SIZE, 0);
+    for (size_t i = 0; i < kept.size(); i++)
+        image[kept[i]] = original[kept[i]];
+    return kept.size();
+}
+
+// @return Where result diverged, as precisely as it is known
+string describe_divergence(const CheckResult& result)
+{
+    ostringstream out;
+    if (result.chunk == 1)
+        out << "after " << result.step << " steps, at pc " << result.pc;
+    else
+        out << "within steps [" << result.step << ", " << result.step + result.chunk << "), from pc " << result.pc <<
+            " (no single step there diverges)";
+    return out.str();
+}
+
+/*
+    Checks the program in image on machines of type M, reporting the first
+    divergence and, if reduce_path is not empty, reducing it.
+
+    @return The process exit code
+*/
+template <class M>
+int check_program(vector<uint16_t>& image, Engine candidate, size_t checkpoint, size_t max_steps, const string& reduce_path)
+{
+    CheckResult result = check_image<M>(image.data(), candidate, checkpoint, max_steps, true);
+    if (!result.diverged)
+    {
+        cout << "match: " << engine_name(candidate) << " agrees with reference" << endl;
+        return 0;
+    }
+    cout << "divergence " << describe_divergence(result) << ": " << result.detail << endl;
+
+    if (!reduce_path.empty())
+    {
+        // zeroed words can turn a halting program into an endless one, so
+        // trials get a budget scaled to the original divergence, not max_steps
+        size_t trial_steps = min(max_steps, max((size_t)10000, 2 * (result.step + checkpoint)));
+        size_t words = reduce_image<M>(image.data(), candidate, trial_steps);
+        size_t last = MEM_SIZE;
+        while (last > 0 && image[last - 1] == 0)
+            last--;
+        ofstream out(reduce_path);
+        if (!out.is_open()) {
+            cerr << "Can't write "<<reduce_path<<endl;
+            return 1;
+        }
+        write_machine_code(out, image.data(), last);
+        CheckResult reduced = check_image<M>(image.data(), candidate, checkpoint, max_steps, true);
+        cout << "reduced to " << words << " non-zero words, written to " << reduce_path << endl;
+        cout << "reduced divergence " << describe_divergence(reduced) << ": " << reduced.detail << endl;
+    }
+    return 1;
+}
+
+/**
+    Main function
+    Takes command-line args as documented below
+*/
+int main(int argc, char *argv[]) {
+    /*
+        Parse the command-line arguments
+    */
+    char* filename = nullptr;
+    bool do_help = false;
+    bool arg_error = false;
+    bool paged = false;
+    Engine candidate = ENGINE_PREDECODED;
+    size_t checkpoint = 1000;
+    size_t max_steps = 10000000;
+    string reduce_path;
+    for (int i=1; i<argc; i++) {
+        string arg(argv[i]);
+        if (arg.rfind("-",0)==0) {
+            if (arg== "-h" || arg == "--help")
+                do_help = true;
+            else if (arg == "--paged")
+                paged = true;
+            else if (i + 1 >= argc)
+                arg_error = true;
+            else if (arg == "--engine")
+                arg_error = !parse_engine(argv[++i], candidate) || arg_error;
+            else if (arg == "--checkpoint")
+                arg_error = !parse_number(argv[++i], checkpoint) || arg_error;
+            else if (arg == "--max-steps")
+                arg_error = !parse_number(argv[++i], max_steps) || arg_error;
+            else if (arg == "--reduce")
+                reduce_path = argv[++i];
+            else
+                arg_error = true;
+        } else {
+            if (filename == nullptr)
+                filename = argv[i];
+            else
+                arg_error = true;
+        }
+    }
+    /* Display error message if appropriate */
+    if (arg_error || do_help || filename == nullptr || checkpoint == 0 || max_steps == 0) {
+        cerr << "usage " << argv[0] << " [-h] [--engine ENGINE] [--checkpoint N] [--max-steps N]" << endl;
+        cerr << "       [--paged] [--reduce OUT] filename" << endl << endl;
+        cerr << "Cross-check an E20 engine against the reference interpreter" << endl << endl;
+        cerr << "positional arguments:" << endl;
+        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
+        cerr << "optional arguments:"<<endl;
+        cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  --engine ENGINE  candidate engine (default predecoded)"<<endl;
+        cerr << "  --checkpoint N  compare full state every N steps; 1 runs in lockstep"<<endl;
+        cerr << "                (default 1000)"<<endl;
+        cerr << "  --max-steps N  give up after N steps (default 10000000)"<<endl;
+        cerr << "  --paged     run on copy-on-write paged memory, so checkpoints share"<<endl;
+        cerr << "                unchanged pages"<<endl;
+        cerr << "  --reduce OUT  on divergence, delta-debug the image and write the"<<endl;
+        cerr << "                minimal reproducer to OUT"<<endl;
+        return 1;
+    }
+
+    ifstream f(filename);
+    if (!f.is_open()) {
+        cerr << "Can't open file "<<filename<<endl;
+        return 1;
+    }
+    vector<uint16_t> image(MEM_SIZE, 0);
+    if (!load_machine_code(f, image.data()))
+        return 1;
+
+    if (paged)
+        return check_program<PagedMachine<MEM_SIZE>>(image, candidate, checkpoint, max_steps, reduce_path);
+    return check_program<Machine>(image, candidate, checkpoint, max_steps, reduce_path);
+}
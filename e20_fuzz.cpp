@@ -0,0 +1,618 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "e20_machine.h"
+
+using namespace std;
+
+/*
+Notes:
+An input is a short code image loaded at address 0 plus a short block of
+data loaded at DATA_BASE. Each input runs on the reference interpreter
+(instrumented for edge coverage) and then on a candidate engine, the one
+given with --engine or else each fast engine in turn; any difference in
+the final state is a bug in that engine.
+*/
+
+size_t const static PC_MAP_SIZE = 1<<16; // hashed (prev_pc, pc) edge entries at the start of the map
+size_t const static NUM_KINDS = OP_UNKNOWN + 2; // coverage kinds: every Op, then OUTSIDE
+size_t const static MAP_SIZE = PC_MAP_SIZE + NUM_KINDS * NUM_KINDS * 4; // edge coverage bitmap entries, then kind edges; see kind_edge()
+size_t const static MAX_CODE_WORDS = 256;
+size_t const static MAX_DATA_WORDS = 64;
+size_t const static DATA_BASE = MEM_SIZE / 2;
+uint32_t const static OUTSIDE_PC = MEM_SIZE; // coverage id of every pc outside the input
+uint32_t const static OUTSIDE = OP_UNKNOWN + 1; // coverage kind of every pc outside the input
+
+struct FuzzInput
+{
+    vector<uint16_t> code; // loaded at address 0
+    vector<uint16_t> data; // loaded at DATA_BASE
+};
+
+/*
+    A corpus input, with what it takes to cull it. Its input is immutable,
+    so threads share it by pointer instead of copying it.
+*/
+struct CorpusEntry
+{
+    shared_ptr<const FuzzInput> input;
+    size_t words = 0; // code plus data; the smaller input wins an (edge, bucket)
+    size_t favoured = 0; // (edge, bucket) pairs this is the smallest input for
+    size_t index = 0; // position in Shared::corpus
+};
+
+/*
+    State shared by every fuzzing thread. The corpus keeps the seeds plus,
+    as AFL's culling does, only inputs that are the smallest to reach some
+    (edge, bucket) pair, so it is bounded by the coverage rather than
+    growing with every find. It and the virgin map are touched only under
+    the mutex; threads work from their own snapshots in between.
+*/
+struct Shared
+{
+    mutex lock;
+    vector<shared_ptr<CorpusEntry>> corpus;
+    vector<CorpusEntry*> top_rated; // per edge * 8 + bucket bit, the smallest input reaching it
+    uint64_t corpus_version = 0; // bumped whenever corpus changes, so unchanged snapshots are kept
+    vector<uint8_t> virgin; // per edge, the hit-count buckets seen so far
+    size_t edges = 0; // edges with at least one bucket seen
+    atomic<uint64_t> execs{0};
+    atomic<bool> stop{false};
+    bool diverged = false;
+    string corpus_dir; // where new inputs and divergences are written; empty for the current directory
+    size_t files_written = 0;
+};
+
+/*
+    Maps a hit count to one of AFL's eight buckets, as a single bit, so that
+    a loop running 5 times instead of 4 is not new coverage but one running
+    8 times is.
+*/
+uint8_t count_bucket(uint8_t count)
+{
+    if (count == 0) return 0;
+    if (count == 1) return 1;
+    if (count == 2) return 2;
+    if (count == 3) return 4;
+    if (count < 8) return 8;
+    if (count < 16) return 16;
+    if (count < 32) return 32;
+    if (count < 128) return 64;
+    return 128;
+}
+
+void load_input(Machine& machine, const FuzzInput& input)
+{
+    machine.reset();
+    memcpy(machine.memory_arr, input.code.data(), input.code.size() * sizeof(uint16_t));
+    memcpy(machine.memory_arr + DATA_BASE, input.data.data(), input.data.size() * sizeof(uint16_t));
+}
+
+/*
+    Loads input into a run that has been prepared once on zeroed memory,
+    as load_input() and prepare() would, without touching all of memory.
+    The input's own pages are marked dirty as it is copied in, so the
+    dirty pages cover everything that is not zero: they alone are cleared
+    and predecoded again, and only the words the trace engine counted or
+    compiled are reset. Marking them also makes compare_runs() check the
+    input's pages, which costs a few pages more.
+*/
+void reload_input(EngineRun& run, const FuzzInput& input)
+{
+    Machine& machine = run.machine;
+    bool decoded = run.engine != ENGINE_REFERENCE;
+    for (size_t p = 0; p < Machine::NUM_PAGES; p++)
+    {
+        if (!machine.dirty.test(p))
+            continue;
+        memset(machine.memory_arr + p * PAGE_WORDS, 0, PAGE_WORDS * sizeof(uint16_t));
+        if (decoded)
+            fill(run.decoded.begin() + p * PAGE_WORDS, run.decoded.begin() + (p + 1) * PAGE_WORDS, decode(0));
+    }
+    machine.reset_state();
+    machine.dirty.clear();
+    if (run.engine == ENGINE_TRACE)
+        run.traces.clear<Machine>();
+
+    auto copy_in = [&](size_t base, const vector<uint16_t>& words) {
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            machine.memory_arr[base + i] = words[i];
+            if (decoded)
+                run.decoded[base + i] = decode(words[i]);
+        }
+        for (size_t addr = base; addr < base + words.size(); addr += PAGE_WORDS)
+            machine.dirty.mark(addr);
+        if (!words.empty())
+            machine.dirty.mark(base + words.size() - 1);
+    };
+    copy_in(0, input.code);
+    copy_in(DATA_BASE, input.data);
+}
+
+/*
+    The coverage id of a pc: the pc itself inside the input's code or
+    data, else OUTSIDE_PC, so that falling through zero-filled memory or
+    jumping to a random address is one edge, not a new one per address.
+*/
+uint32_t coverage_id(uint16_t pc, const FuzzInput& input)
+{
+    size_t addr = pc % MEM_SIZE;
+    if (addr < input.code.size() || (addr >= DATA_BASE && addr < DATA_BASE + input.data.size()))
+        return addr;
+    return OUTSIDE_PC;
+}
+
+/*
+    The coverage kind of the instruction at a pc with coverage id id: its
+    operation inside the input's code or data, else OUTSIDE.
+*/
+uint32_t coverage_kind(const Machine& machine, uint32_t id)
+{
+    return id == OUTSIDE_PC ? OUTSIDE : decode(machine.memory_arr[id]).op;
+}
+
+/*
+    The kind edge of one step, counted on top of its pc edge: the kinds of
+    the instructions it went from and to, and whether it fell through,
+    jumped forward, jumped back or stayed put. Inserting or deleting a
+    word shifts every pc edge after it, but keeps these.
+*/
+uint32_t kind_edge(uint32_t from_kind, uint16_t from_pc, uint32_t to_kind, uint16_t to_pc)
+{
+    uint32_t direction = to_pc == (uint16_t)(from_pc + 1) ? 0 : to_pc > from_pc ? 1 : to_pc < from_pc ? 2 : 3;
+    return PC_MAP_SIZE + (from_kind * NUM_KINDS + to_kind) * 4 + direction;
+}
+
+// Counts one hit of edge in trace, noting it in touched the first time
+inline void count_edge(uint8_t trace[], vector<uint32_t>& touched, uint32_t edge)
+{
+    if (trace[edge] == 0)
+        touched.push_back(edge);
+    if (trace[edge] != 255)
+        trace[edge]++;
+}
+
+/*
+    Runs the reference interpreter on the loaded input with a step budget,
+    counting every (prev_pc, pc) edge, hashed as AFL does, and every
+    kind_edge() in trace. Indices of trace entries that become non-zero
+    are appended to touched so the caller can clear just those.
+
+    @return The number of instructions executed
+*/
+size_t run_reference_with_coverage(Machine& machine, const FuzzInput& input, size_t max_steps, uint8_t trace[], vector<uint32_t>& touched)
+{
+    size_t steps = 0;
+    Status status = STATUS_RUNNING;
+    uint32_t from_id = coverage_id(machine.pc, input);
+    uint32_t from_kind = coverage_kind(machine, from_id);
+    while (status == STATUS_RUNNING && steps < max_steps)
+    {
+        steps++;
+        uint16_t from_pc = machine.pc % MEM_SIZE;
+        status = step_e20(machine);
+        uint32_t to_id = coverage_id(machine.pc, input);
+        uint32_t to_kind = coverage_kind(machine, to_id);
+        count_edge(trace, touched, (from_id * 40503u ^ to_id) & (PC_MAP_SIZE - 1));
+        count_edge(trace, touched, kind_edge(from_kind, from_pc, to_kind, machine.pc % MEM_SIZE));
+        from_id = to_id;
+        from_kind = to_kind;
+    }
+    machine.status = status;
+    return steps;
+}
+
+/*
+    Returns a random, well-formed E20 instruction. Immediates favour small
+    values so that branches and loads stay near the code and data.
+*/
+uint16_t random_instruction(mt19937_64& rng)
+{
+    static const uint16_t funcs[6] = {0, 1, 2, 3, 4, 8};
+    uint16_t opcode = rng() % 8;
+    uint16_t reg_a = rng() % NUM_REGS;
+    uint16_t reg_b = rng() % NUM_REGS;
+    uint16_t reg_dst = rng() % NUM_REGS;
+    uint16_t imm7 = (rng() % 16 - 8) & 127;
+    if (opcode == 0)
+        return (reg_a << 10) | (reg_b << 7) | (reg_dst << 4) | funcs[rng() % 6];
+    if (opcode == 2 || opcode == 3)
+        return (opcode << 13) | (rng() % MAX_CODE_WORDS);
+    if (opcode == 4 || opcode == 5)
+        imm7 = rng() % 64;
+    return (opcode << 13) | (reg_a << 10) | (reg_b << 7) | imm7;
+}
+
+/*
+    Applies one to four random mutations to input. other is another corpus
+    entry, used for splicing.
+*/
+void mutate(FuzzInput& input, const FuzzInput& other, mt19937_64& rng)
+{
+    static const uint16_t interesting[6] = {0, 1, 0x7f, 0x8000, 0xfffe, 0xffff};
+    size_t rounds = 1 + rng() % 4;
+    for (size_t r = 0; r < rounds; r++)
+    {
+        vector<uint16_t>& code = input.code;
+        switch (rng() % 8)
+        {
+        case 0: // flip one bit
+            if (!code.empty())
+                code[rng() % code.size()] ^= 1 << (rng() % 16);
+            break;
+        case 1: // replace a word with a valid instruction
+            if (!code.empty())
+                code[rng() % code.size()] = random_instruction(rng);
+            break;
+        case 2: // nudge an immediate
+            if (!code.empty())
+            {
+                uint16_t& word = code[rng() % code.size()];
+                word = (word & ~127) | ((word + (rng() % 5) - 2) & 127);
+            }
+            break;
+        case 3: // insert a valid instruction
+            if (code.size() < MAX_CODE_WORDS)
+                code.insert(code.begin() + rng() % (code.size() + 1), random_instruction(rng));
+            break;
+        case 4: // delete a word
+            if (code.size() > 1)
+                code.erase(code.begin() + rng() % code.size());
+            break;
+        case 5: // insert a halt, so mutants do not all run to the step budget
+            if (code.size() < MAX_CODE_WORDS)
+            {
+                size_t at = rng() % (code.size() + 1);
+                code.insert(code.begin() + at, (2 << 13) | at);
+            }
+            break;
+        case 6: // change a data word
+            if (input.data.size() < MAX_DATA_WORDS && (input.data.empty() || rng() % 2 == 0))
+                input.data.push_back(interesting[rng() % 6]);
+            else
+                input.data[rng() % input.data.size()] = rng() % 2 ? interesting[rng() % 6] : (uint16_t)rng();
+            break;
+        case 7: // splice in the tail of another input
+            if (!other.code.empty())
+            {
+                size_t cut = rng() % (code.size() + 1);
+                size_t from = rng() % other.code.size();
+                code.resize(cut);
+                code.insert(code.end(), other.code.begin() + from, other.code.end());
+                if (code.size() > MAX_CODE_WORDS)
+                    code.resize(MAX_CODE_WORDS);
+            }
+            break;
+        }
+    }
+}
+
+/*
+    Writes an input as a machine code file that e20_sim can load directly.
+*/
+void write_input(const string& path, const FuzzInput& input)
+{
+    vector<Machine> machine(1);
+    load_input(machine[0], input);
+    size_t words = input.data.empty() ? input.code.size() : DATA_BASE + input.data.size();
+    ofstream out(path);
+    write_machine_code(out, machine[0].memory_arr, words);
+}
+
+string output_path(Shared& shared, const string& name)
+{
+    return (shared.corpus_dir.empty() ? string(".") : shared.corpus_dir) + "/" + name;
+}
+
+/*
+    Adds an input to the corpus. The caller must hold shared.lock.
+
+    @return The new entry, for add_coverage()
+*/
+CorpusEntry* add_entry(Shared& shared, const FuzzInput& input)
+{
+    shared_ptr<CorpusEntry> entry = make_shared<CorpusEntry>();
+    entry->input = make_shared<const FuzzInput>(input);
+    entry->words = input.code.size() + input.data.size();
+    entry->index = shared.corpus.size();
+    shared.corpus.push_back(entry);
+    shared.corpus_version++;
+    return entry.get();
+}
+
+/*
+    Makes entry the top-rated input for each (edge, bucket) pair in trace
+    where it is smaller than the current one, and drops entries that are
+    left top-rated for nothing. Seeds, which never become top-rated until
+    they are rerun, are never dropped. The caller must hold shared.lock.
+*/
+void add_coverage(Shared& shared, CorpusEntry* entry, const uint8_t trace[], const vector<uint32_t>& touched)
+{
+    for (size_t i = 0; i < touched.size(); i++)
+    {
+        CorpusEntry*& top = shared.top_rated[touched[i] * 8 + __builtin_ctz(count_bucket(trace[touched[i]]))];
+        if (top != nullptr && top->words <= entry->words)
+            continue;
+        entry->favoured++;
+        if (top != nullptr && --top->favoured == 0)
+        {
+            size_t index = top->index; // swap it out with the last entry
+            shared.corpus[index] = shared.corpus.back();
+            shared.corpus[index]->index = index;
+            shared.corpus.pop_back();
+            shared.corpus_version++;
+        }
+        top = entry;
+    }
+}
+
+/*
+    Brings a thread's snapshot up to date with the shared state. Entries
+    can be culled, so the snapshot is rebuilt whenever the corpus changed;
+    it copies only pointers to the shared, immutable inputs, but threads
+    still do this only periodically, not after every find.
+    The caller must hold shared.lock.
+*/
+void sync_snapshot(Shared& shared, vector<shared_ptr<const FuzzInput>>& corpus, uint64_t& corpus_version, vector<uint8_t>& virgin)
+{
+    if (corpus_version != shared.corpus_version || corpus.empty())
+    {
+        corpus.resize(shared.corpus.size());
+        for (size_t i = 0; i < corpus.size(); i++)
+            corpus[i] = shared.corpus[i]->input;
+        corpus_version = shared.corpus_version;
+    }
+    virgin = shared.virgin;
+}
+
+/*
+    One fuzzing thread: mutate, run on the reference interpreter and on
+    the next of engines, keep inputs that reach new coverage, stop
+    everything on the first divergence.
+*/
+void fuzz_worker(Shared& shared, const vector<Engine>& engines, uint64_t seed, uint64_t runs, size_t max_steps)
+{
+    mt19937_64 rng(seed);
+    vector<EngineRun> reference(1);
+    reference[0].engine = ENGINE_REFERENCE;
+    vector<EngineRun> candidates(NUM_ENGINES); // one per engine, so each keeps its side tables between inputs
+    for (size_t e = 0; e < candidates.size(); e++)
+        candidates[e].engine = (Engine)e;
+    reference[0].machine.reset();
+    for (size_t e = 0; e < candidates.size(); e++) // on zeroed memory, as reload_input() expects
+    {
+        candidates[e].machine.reset();
+        candidates[e].prepare();
+    }
+    vector<uint8_t> trace(MAP_SIZE, 0);
+    vector<uint32_t> touched;
+    vector<shared_ptr<const FuzzInput>> corpus;
+    uint64_t corpus_version = 0;
+    vector<uint8_t> virgin;
+    uint64_t local_execs = 0;
+
+    while (!shared.stop)
+    {
+        if (local_execs % 4096 == 0) // refresh the snapshot of the shared corpus and coverage
+        {
+            lock_guard<mutex> lock(shared.lock);
+            sync_snapshot(shared, corpus, corpus_version, virgin);
+        }
+        uint64_t exec = shared.execs++;
+        if (runs != 0 && exec >= runs)
+            break;
+        local_execs++;
+
+        FuzzInput input = *corpus[rng() % corpus.size()];
+        mutate(input, *corpus[rng() % corpus.size()], rng);
+
+        reload_input(reference[0], input);
+        for (size_t i = 0; i < touched.size(); i++)
+            trace[touched[i]] = 0;
+        touched.clear();
+        size_t reference_steps = run_reference_with_coverage(reference[0].machine, input, max_steps, trace.data(), touched);
+
+        EngineRun& candidate = candidates[engines[exec % engines.size()]];
+        reload_input(candidate, input);
+        size_t candidate_steps = candidate.run(max_steps);
+
+        string divergence = compare_runs(reference[0], reference_steps, candidate, candidate_steps);
+        if (!divergence.empty())
+        {
+            lock_guard<mutex> lock(shared.lock);
+            if (!shared.diverged)
+            {
+                shared.diverged = true;
+                string path = output_path(shared, "divergence-" + to_string(exec) + ".bin");
+                write_input(path, input);
+                cerr << "divergence on " << engine_name(candidate.engine) << " after " << exec << " execs: " << divergence << endl;
+                cerr << "reproducer written to " << path << endl;
+            }
+            shared.stop = true;
+            break;
+        }
+
+        bool new_coverage = false;
+        for (size_t i = 0; i < touched.size(); i++)
+        {
+            if (count_bucket(trace[touched[i]]) & ~virgin[touched[i]])
+            {
+                new_coverage = true;
+                break;
+            }
+        }
+        if (new_coverage)
+        {
+            lock_guard<mutex> lock(shared.lock);
+            bool still_new = false; // another thread may have found the same edges first
+            for (size_t i = 0; i < touched.size(); i++)
+            {
+                uint8_t bucket = count_bucket(trace[touched[i]]);
+                if (bucket & ~shared.virgin[touched[i]])
+                {
+                    if (shared.virgin[touched[i]] == 0)
+                        shared.edges++;
+                    shared.virgin[touched[i]] |= bucket;
+                    still_new = true;
+                }
+            }
+            if (still_new)
+            {
+                CorpusEntry* entry = add_entry(shared, input);
+                add_coverage(shared, entry, trace.data(), touched);
+                corpus.push_back(entry->input); // the rest of the corpus waits for the next periodic sync
+                if (!shared.corpus_dir.empty())
+                    write_input(output_path(shared, "input-" + to_string(shared.files_written++) + ".bin"), input);
+            }
+            virgin = shared.virgin;
+        }
+    }
+}
+
+/*
+    Turns a loaded seed image into a fuzz input: words below DATA_BASE
+    become code (up to MAX_CODE_WORDS), words from DATA_BASE become data.
+*/
+FuzzInput seed_from_machine(const Machine& machine)
+{
+    FuzzInput input;
+    size_t code_words = DATA_BASE;
+    while (code_words > 0 && machine.memory_arr[code_words - 1] == 0)
+        code_words--;
+    input.code.assign(machine.memory_arr, machine.memory_arr + min(code_words, MAX_CODE_WORDS));
+    size_t data_words = MAX_DATA_WORDS;
+    while (data_words > 0 && machine.memory_arr[DATA_BASE + data_words - 1] == 0)
+        data_words--;
+    input.data.assign(machine.memory_arr + DATA_BASE, machine.memory_arr + DATA_BASE + data_words);
+    if (input.code.empty())
+        input.code.push_back(2 << 13); // halt at 0
+    return input;
+}
+
+/**
+    Main function
+    Takes command-line args as documented below
+*/
+int main(int argc, char *argv[]) {
+    /*
+        Parse the command-line arguments
+    */
+    vector<char*> seed_files;
+    bool do_help = false;
+    bool arg_error = false;
+    size_t num_threads = thread::hardware_concurrency();
+    uint64_t runs = 0;
+    size_t max_steps = 10000;
+    uint64_t seed = 1;
+    string corpus_dir;
+    vector<Engine> engines;
+    for (int i=1; i<argc; i++) {
+        string arg(argv[i]);
+        if (arg.rfind("-",0)==0) {
+            if (arg== "-h" || arg == "--help")
+                do_help = true;
+            else if (i + 1 >= argc)
+                arg_error = true;
+            else if (arg == "--threads")
+                arg_error = !parse_number(argv[++i], num_threads) || arg_error;
+            else if (arg == "--runs")
+                arg_error = !parse_number(argv[++i], runs) || arg_error;
+            else if (arg == "--max-steps")
+                arg_error = !parse_number(argv[++i], max_steps) || arg_error;
+            else if (arg == "--seed")
+                arg_error = !parse_number(argv[++i], seed) || arg_error;
+            else if (arg == "--engine") {
+                Engine engine = ENGINE_PREDECODED;
+                arg_error = !parse_engine(argv[++i], engine) || arg_error;
+                engines.assign(1, engine);
+            }
+            else if (arg == "--corpus")
+                corpus_dir = argv[++i];
+            else
+                arg_error = true;
+        } else {
+            seed_files.push_back(argv[i]);
+        }
+    }
+    /* Display error message if appropriate */
+    if (arg_error || do_help || max_steps == 0) {
+        cerr << "usage " << argv[0] << " [-h] [--engine ENGINE] [--threads N] [--runs N] [--max-steps N]" << endl;
+        cerr << "       [--seed N] [--corpus DIR] [seed ...]" << endl << endl;
+        cerr << "Coverage-guided fuzzer checking the fast E20 engines against the" << endl;
+        cerr << "reference interpreter" << endl << endl;
+        cerr << "positional arguments:" << endl;
+        cerr << "  seed        Machine code files to start the corpus from" << endl<<endl;
+        cerr << "optional arguments:"<<endl;
+        cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  --engine ENGINE  candidate engine (default: predecoded, trace and"<<endl;
+        cerr << "                threaded in turn)"<<endl;
+        cerr << "  --threads N  fuzzing threads sharing one corpus (default: one per core)"<<endl;
+        cerr << "  --runs N    stop after N executions (default: run until a divergence)"<<endl;
+        cerr << "  --max-steps N  step budget per execution (default 10000)"<<endl;
+        cerr << "  --seed N    random seed"<<endl;
+        cerr << "  --corpus DIR  write inputs with new coverage, and any divergence, to DIR"<<endl;
+        return 1;
+    }
+
+    if (engines.empty())
+        engines = {ENGINE_PREDECODED, ENGINE_TRACE, ENGINE_THREADED};
+
+    Shared shared;
+    shared.corpus_dir = corpus_dir;
+    shared.virgin.assign(MAP_SIZE, 0);
+    shared.top_rated.assign(MAP_SIZE * 8, nullptr);
+    for (size_t i = 0; i < seed_files.size(); i++)
+    {
+        ifstream f(seed_files[i]);
+        if (!f.is_open()) {
+            cerr << "Can't open file "<<seed_files[i]<<endl;
+            return 1;
+        }
+        vector<Machine> machine(1);
+        machine[0].reset();
+        if (!load_machine_code(f, machine[0].memory_arr))
+            return 1;
+        add_entry(shared, seed_from_machine(machine[0]));
+    }
+    if (shared.corpus.empty())
+    {
+        FuzzInput halt_only;
+        halt_only.code.push_back(2 << 13);
+        add_entry(shared, halt_only);
+    }
+
+    vector<thread> workers;
+    for (size_t t = 0; t < max((size_t)1, num_threads); t++)
+        workers.push_back(thread(fuzz_worker, ref(shared), cref(engines), seed * 1000003 + t, runs, max_steps));
+
+    auto start = chrono::steady_clock::now();
+    uint64_t last_execs = 0;
+    while (!shared.stop && (runs == 0 || shared.execs < runs))
+    {
+        this_thread::sleep_for(chrono::seconds(1));
+        uint64_t execs = shared.execs;
+        lock_guard<mutex> lock(shared.lock);
+        cerr << "#" << execs << "\texec/s: " << execs - last_execs << "\tcorpus: " << shared.corpus.size() << "\tedges: " << shared.edges << endl;
+        last_execs = execs;
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << "done: " << min(shared.execs.load(), runs == 0 ? shared.execs.load() : runs) << " execs in " << seconds << "s, corpus " << shared.corpus.size() << ", edges " << shared.edges << endl;
+    return shared.diverged ? 1 : 0;
+}
@@ -0,0 +1,384 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "e20_machine.h"
+
+using namespace std;
+
+/*
+Notes:
+Grades a batch of E20 programs. A manifest lists one submission per line,
+"ID PROGRAM EXPECTED", where EXPECTED is a binary final state (pc,
+registers and all of memory) that --expect writes from a known-good run.
+Worker threads each reuse one machine, run their submissions to the halt
+and compare the final state with the expected one word by word, eight or
+sixteen words per SIMD compare, instead of diffing print_state text. One
+verdict line per submission is written as it finishes:
+
+    ID pass
+    ID fail WHERE expected E got A
+    ID STATUS [WHERE expected E got A]    (illegal, step-limit, timeout)
+    ID error MESSAGE
+
+where WHERE is pc, $R or memory[ADDR], the first word that differs.
+*/
+
+// A final state as one run of words: pc, then the registers, then memory
+size_t const static STATE_WORDS = 1 + NUM_REGS + MEM_SIZE;
+char const static STATE_MAGIC[8] = {'E', '2', '0', 'S', 'T', 'A', 'T', 'E'};
+
+/*
+    Flattens a machine's final state into state, which holds STATE_WORDS.
+*/
+void capture_state(const Machine& machine, uint16_t state[])
+{
+    state[0] = machine.pc;
+    memcpy(state + 1, machine.regs_arr, sizeof(machine.regs_arr));
+    memcpy(state + 1 + NUM_REGS, machine.memory_arr, sizeof(machine.memory_arr));
+}
+
+/*
+    Writes a state file: the magic, then the STATE_WORDS words, each
+    little-endian whatever the host.
+
+    @return false if the file could not be written
+*/
+bool write_state(const string& path, const uint16_t state[])
+{
+    vector<unsigned char> bytes(sizeof(STATE_MAGIC) + 2 * STATE_WORDS);
+    memcpy(bytes.data(), STATE_MAGIC, sizeof(STATE_MAGIC));
+    for (size_t i = 0; i < STATE_WORDS; i++)
+    {
+        bytes[sizeof(STATE_MAGIC) + 2 * i] = state[i] & 255;
+        bytes[sizeof(STATE_MAGIC) + 2 * i + 1] = state[i] >> 8;
+    }
+    ofstream out(path, ios::binary);
+    out.write((const char*)bytes.data(), bytes.size());
+    return (bool)out;
+}
+
+/*
+    Reads a state file written by write_state().
+
+    @param err Where to say why the file could not be read
+    @return false if it could not
+*/
+bool read_state(const string& path, vector<uint16_t>& state, string& err)
+{
+    ifstream in(path, ios::binary);
+    if (!in.is_open())
+    {
+        err = "can't open " + path;
+        return false;
+    }
+    vector<unsigned char> bytes(sizeof(STATE_MAGIC) + 2 * STATE_WORDS);
+    in.read((char*)bytes.data(), bytes.size());
+    if (!in || in.peek() != EOF || memcmp(bytes.data(), STATE_MAGIC, sizeof(STATE_MAGIC)) != 0)
+    {
+        err = path + " is not an E20 state file";
+        return false;
+    }
+    state.resize(STATE_WORDS);
+    for (size_t i = 0; i < STATE_WORDS; i++)
+        state[i] = bytes[sizeof(STATE_MAGIC) + 2 * i] | (bytes[sizeof(STATE_MAGIC) + 2 * i + 1] << 8);
+    return true;
+}
+
+/*
+    Finds the first word at which two states differ, comparing a vector
+    register's worth of words at a time and only looking for the exact
+    word once a block differs.
+
+    @return The index of the first differing word, or words if none
+*/
+size_t first_mismatch(const uint16_t expected[], const uint16_t actual[], size_t words)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= words; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(expected + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(actual + i));
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi16(a, b));
+        if (equal != 0xffffffffu)
+            return i + __builtin_ctz(~equal) / 2;
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= words; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(expected + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(actual + i));
+        unsigned equal = _mm_movemask_epi8(_mm_cmpeq_epi16(a, b));
+        if (equal != 0xffffu)
+            return i + __builtin_ctz(~equal) / 2;
+    }
+#endif
+    for (; i < words; i++) // the tail, or everything without SIMD
+    {
+        if (expected[i] != actual[i])
+            return i;
+    }
+    return words;
+}
+
+// @return What word index of a state holds: pc, $R or memory[ADDR]
+string state_word_name(size_t index)
+{
+    if (index == 0)
+        return "pc";
+    if (index <= NUM_REGS)
+        return "$" + to_string(index - 1);
+    return "memory[" + to_string(index - 1 - NUM_REGS) + "]";
+}
+
+/*
+    One line of the manifest.
+*/
+struct Submission
+{
+    string id;
+    string program; // path of the machine code
+    string expected; // path of the expected state
+};
+
+/*
+    Options shared by every worker.
+*/
+struct GradeConfig
+{
+    Engine engine = ENGINE_PREDECODED;
+    size_t max_steps = 10000000;
+    double timeout = 0; // seconds per submission; 0 for none
+    bool write_expected = false; // --expect: write each halting run's state instead of comparing
+};
+
+/*
+    Runs one submission on a worker's run and returns its verdict line.
+
+    @param expected The expected state, or null with --expect
+    @param passed Set if the submission passed (or its state was written)
+*/
+string grade(EngineRun& run, const Submission& submission, const vector<uint16_t>* expected, const GradeConfig& config,
+    vector<uint16_t>& actual, bool& passed)
+{
+    passed = false;
+    Machine& machine = run.machine;
+    machine.reset();
+    machine.step_limit = config.max_steps;
+    ifstream f(submission.program);
+    if (!f.is_open())
+        return submission.id + " error can't open " + submission.program + "\n";
+    ostringstream load_err;
+    if (!load_machine_code(f, machine.memory_arr, load_err))
+    {
+        string message = load_err.str();
+        message = message.substr(0, message.find('\n'));
+        return submission.id + " error " + submission.program + ": " + message + "\n";
+    }
+    run.engine = config.engine;
+    run.prepare();
+    {
+        Watchdog watchdog; // a thread only when armed, so only with --timeout
+        if (config.timeout > 0)
+        {
+            machine.timeout = &watchdog.expired;
+            watchdog.arm(config.timeout);
+        }
+        run.run();
+        machine.timeout = nullptr;
+    }
+
+    capture_state(machine, actual.data());
+    string verdict = machine.status == STATUS_HALTED ? "pass" : status_name(machine.status);
+    if (config.write_expected)
+    {
+        if (machine.status != STATUS_HALTED)
+            return submission.id + " " + verdict + "\n"; // only halting runs make a reference
+        if (!write_state(submission.expected, actual.data()))
+            return submission.id + " error can't write " + submission.expected + "\n";
+        passed = true;
+        return submission.id + " written\n";
+    }
+
+    size_t differs = first_mismatch(expected->data(), actual.data(), STATE_WORDS);
+    if (differs == STATE_WORDS)
+    {
+        passed = machine.status == STATUS_HALTED;
+        return submission.id + " " + verdict + "\n";
+    }
+    if (machine.status == STATUS_HALTED)
+        verdict = "fail";
+    return submission.id + " " + verdict + " " + state_word_name(differs) + " expected " + to_string((*expected)[differs]) +
+        " got " + to_string(actual[differs]) + "\n";
+}
+
+/*
+    Grades every submission on a pool of worker threads, writing each
+    verdict to out as it is ready.
+
+    @param expected_states Each distinct expected path, already read, so
+        submissions of the same test share one copy
+    @return The number of submissions that did not pass
+*/
+size_t grade_all(const vector<Submission>& submissions, const map<string, vector<uint16_t>>& expected_states, const GradeConfig& config,
+    size_t num_threads, ostream& out)
+{
+    atomic<size_t> next{0};
+    atomic<size_t> failed{0};
+    mutex out_mutex;
+    vector<thread> workers;
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        workers.push_back(thread([&]() {
+            vector<EngineRun> run(1);
+            vector<uint16_t> actual(STATE_WORDS);
+            for (size_t i = next++; i < submissions.size(); i = next++)
+            {
+                const vector<uint16_t>* expected = nullptr;
+                if (!config.write_expected)
+                    expected = &expected_states.at(submissions[i].expected);
+                bool passed;
+                string verdict = grade(run[0], submissions[i], expected, config, actual, passed);
+                if (!passed)
+                    failed++;
+                lock_guard<mutex> lock(out_mutex);
+                out << verdict;
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    out.flush();
+    return failed;
+}
+
+/**
+    Main function
+    Takes command-line args as documented below
+*/
+int main(int argc, char *argv[]) {
+    /*
+        Parse the command-line arguments
+    */
+    char* manifest_path = nullptr;
+    bool do_help = false;
+    bool arg_error = false;
+    GradeConfig config;
+    size_t num_threads = thread::hardware_concurrency();
+    for (int i=1; i<argc; i++) {
+        string arg(argv[i]);
+        if (arg.rfind("-",0)==0) {
+            if (arg== "-h" || arg == "--help")
+                do_help = true;
+            else if (arg == "--expect")
+                config.write_expected = true;
+            else if (i + 1 >= argc)
+                arg_error = true;
+            else if (arg == "--engine")
+                arg_error = !parse_engine(argv[++i], config.engine) || arg_error;
+            else if (arg == "--max-steps")
+                arg_error = !parse_number(argv[++i], config.max_steps) || arg_error;
+            else if (arg == "--timeout")
+                arg_error = !parse_positive(argv[++i], config.timeout) || arg_error;
+            else if (arg == "--threads")
+                arg_error = !parse_number(argv[++i], num_threads) || arg_error;
+            else
+                arg_error = true;
+        } else {
+            if (manifest_path == nullptr)
+                manifest_path = argv[i];
+            else
+                arg_error = true;
+        }
+    }
+    /* Display error message if appropriate */
+    if (arg_error || do_help || manifest_path == nullptr || config.max_steps == 0) {
+        cerr << "usage " << argv[0] << " [-h] [--engine ENGINE] [--max-steps N] [--timeout SEC]" << endl;
+        cerr << "       [--threads N] [--expect] manifest" << endl << endl;
+        cerr << "Grade E20 programs against expected final states" << endl << endl;
+        cerr << "positional arguments:" << endl;
+        cerr << "  manifest    One submission per line: ID PROGRAM EXPECTED, where EXPECTED" << endl;
+        cerr << "              is a state file written by --expect" << endl<<endl;
+        cerr << "optional arguments:"<<endl;
+        cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  --engine ENGINE  engine to run submissions on (default predecoded)"<<endl;
+        cerr << "  --max-steps N  stop a submission after about N instructions"<<endl;
+        cerr << "              (default 10000000)"<<endl;
+        cerr << "  --timeout SEC  stop a submission after SEC seconds of wall-clock time"<<endl;
+        cerr << "              (default: no limit)"<<endl;
+        cerr << "  --threads N  number of workers (default: one per core)"<<endl;
+        cerr << "  --expect    instead of grading, run each PROGRAM and write its final"<<endl;
+        cerr << "              state to EXPECTED; each EXPECTED may appear only once"<<endl;
+        return 1;
+    }
+    if (num_threads == 0)
+        num_threads = 1;
+
+    ifstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        cerr << "Can't open file "<<manifest_path<<endl;
+        return 1;
+    }
+    vector<Submission> submissions;
+    map<string, vector<uint16_t>> expected_states;
+    map<string, size_t> written_by; // --expect: the line that writes each EXPECTED, as workers would race on a shared one
+    string line;
+    size_t line_number = 0;
+    while (getline(manifest, line))
+    {
+        line_number++;
+        istringstream fields(line);
+        Submission submission;
+        if (!(fields >> submission.id) || submission.id[0] == '#')
+            continue;
+        string extra;
+        if (!(fields >> submission.program >> submission.expected) || fields >> extra) {
+            cerr << manifest_path << ":" << line_number << ": expected ID PROGRAM EXPECTED" << endl;
+            return 1;
+        }
+        submissions.push_back(submission);
+        if (config.write_expected)
+        {
+            if (written_by.count(submission.expected) != 0) {
+                cerr << manifest_path << ":" << line_number << ": " << submission.expected << " is already written by line " << written_by[submission.expected] << endl;
+                return 1;
+            }
+            written_by[submission.expected] = line_number;
+            continue;
+        }
+        if (expected_states.count(submission.expected) != 0)
+            continue;
+        string err;
+        if (!read_state(submission.expected, expected_states[submission.expected], err)) {
+            cerr << manifest_path << ":" << line_number << ": " << err << endl;
+            return 1;
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    size_t failed = grade_all(submissions, expected_states, config, min(num_threads, max(submissions.size(), (size_t)1)), cout);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << submissions.size() << " submissions, " << submissions.size() - failed << " " << (config.write_expected ? "written" : "passed") <<
+        ", " << failed << " not, in " << seconds << " s" << endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,1926 @@
+#ifndef E20_MACHINE_H
+#define E20_MACHINE_H
+
+/*
+    The E20 machine shared by the simulator tools: loading, state printing,
+    the reference interpreter and the faster engines that must match it.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Some helpful constant values to use
+size_t const static NUM_REGS = 8;
+size_t const static MEM_SIZE = 1<<13;
+size_t const static REG_SIZE = 1<<16;
+size_t const static PAGE_WORDS = 64; // granularity of dirty tracking and of paged memory
+
+/*
+    Loads an E20 machine code file into the list
+    provided by mem. We assume that mem is
+    large enough to hold the values in the machine
+    code file.
+
+    @param f Open file to read from
+    @param mem Array represetnting memory into which to read program
+    @param err Where to report a malformed file
+    @param words Size of mem
+    @return false if the file could not be loaded
+*/
+inline bool load_machine_code(std::istream &f, uint16_t mem[], std::ostream &err = std::cerr, size_t words = MEM_SIZE) {
+    static const std::regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$"); // compiled once per process, not once per program
+    size_t expectedaddr = 0;
+    std::string line;
+    while (std::getline(f, line)) {
+        std::smatch sm;
+        if (!std::regex_match(line, sm, machine_code_re)) {
+            err << "Can't parse line: " << line << std::endl;
+            return false;
+        }
+        size_t addr = std::stoi(sm[1], nullptr, 10);
+        unsigned instr = std::stoi(sm[2], nullptr, 2);
+        if (addr != expectedaddr) {
+            err << "Memory addresses encountered out of sequence: " << addr << std::endl;
+            return false;
+        }
+        if (addr >= words) {
+            err << "Program too big for memory" << std::endl;
+            return false;
+        }
+        expectedaddr ++;
+        mem[addr] = instr;
+    }
+    return true;
+}
+
+/*
+    Why an engine stopped running a machine.
+*/
+enum Status
+{
+    STATUS_RUNNING, // stopped by a step budget or stop pc; can be resumed
+    STATUS_HALTED, // executed a j to itself
+    STATUS_ILLEGAL, // met an undefined instruction under ILLEGAL_STOP; pc points at it
+    STATUS_STEP_LIMIT, // ran past Machine::step_limit
+    STATUS_TIMEOUT // Machine::timeout was set
+};
+
+inline const char* status_name(Status status)
+{
+    static const char* names[] = {"running", "halted", "illegal", "step-limit", "timeout"};
+    return names[status];
+}
+
+/*
+    What to do with an opcode 0 instruction whose function code is not one
+    of add, sub, or, and, slt or jr. Left alone, such a word would never
+    advance pc and the machine would spin on it forever.
+*/
+enum IllegalPolicy
+{
+    ILLEGAL_STOP, // stop with STATUS_ILLEGAL
+    ILLEGAL_NOP, // skip it
+    ILLEGAL_TRAP // raise an E20 exception: like a jal to the trap vector, so $7 holds the address after the faulting word
+};
+
+// @return false if name is not stop, nop or trap
+inline bool parse_illegal_policy(const std::string& name, IllegalPolicy& policy)
+{
+    if (name == "stop")
+        policy = ILLEGAL_STOP;
+    else if (name == "nop")
+        policy = ILLEGAL_NOP;
+    else if (name == "trap")
+        policy = ILLEGAL_TRAP;
+    else
+        return false;
+    return true;
+}
+
+/*
+    Parses a whole-number command-line argument. Only decimal digits are
+    accepted, so an empty string, a sign or a trailing suffix ("10x") is a
+    usage error instead of an exception or a silently truncated value.
+
+    @param min, max The accepted range, inclusive
+    @return false if text is not a number in [min, max]
+*/
+template <class T>
+bool parse_number(const std::string& text, T& value, unsigned long long min = 0, unsigned long long max = std::numeric_limits<T>::max())
+{
+    if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    unsigned long long number = std::stoull(text);
+    if (number < min || number > max)
+        return false;
+    value = (T)number;
+    return true;
+}
+
+// @return false unless all of text is a positive number, such as 2 or 0.5
+inline bool parse_positive(const std::string& text, double& value)
+{
+    char* end = nullptr;
+    double number = std::strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || !(number > 0) || number > 1e9)
+        return false;
+    value = number;
+    return true;
+}
+
+/*
+    The state of an E20 machine apart from its memory, and the limits the
+    engines apply to it.
+*/
+struct MachineState
+{
+    uint16_t pc;
+    uint16_t regs_arr[NUM_REGS];
+    Status status; // set by the engines when they return
+    size_t executed; // instructions executed since reset()
+
+    IllegalPolicy illegal_policy = ILLEGAL_STOP; // configuration, kept across reset()
+    uint16_t trap_vector = 0; // where ILLEGAL_TRAP jumps
+    size_t step_limit = SIZE_MAX; // stop with STATUS_STEP_LIMIT once executed reaches this; see poll_limits()
+    const std::atomic<bool>* timeout = nullptr; // if not null, stop with STATUS_TIMEOUT once it is set
+
+    // pc and registers start at 0
+    void reset_state()
+    {
+        pc = 0;
+        status = STATUS_RUNNING;
+        executed = 0;
+        memset(regs_arr, 0, sizeof(regs_arr));
+    }
+};
+
+/*
+    One bit per PAGE_WORDS-word page, set by every sw to the page, so that
+    what changed since load (or since a snapshot cleared it) is found
+    without comparing all of memory.
+*/
+template <size_t Pages>
+struct DirtyPages
+{
+    uint64_t bits[(Pages + 63) / 64];
+
+    void clear() { memset(bits, 0, sizeof(bits)); }
+
+    void mark(size_t address)
+    {
+        size_t page = address / PAGE_WORDS;
+        bits[page / 64] |= (uint64_t)1 << (page % 64);
+    }
+
+    bool test(size_t page) const { return (bits[page / 64] >> (page % 64)) & 1; }
+};
+
+/*
+    Maps a 16-bit address or pc onto a memory of mem_words words: a mask
+    for power-of-two sizes, else a modulo.
+*/
+template <size_t MemWords>
+inline size_t wrap_address(size_t address)
+{
+    return (MemWords & (MemWords - 1)) == 0 ? address & (MemWords - 1) : address % MemWords;
+}
+
+/*
+    One E20 machine with MemWords words of memory. Server workers keep one
+    each and reset it between jobs instead of building a new one. The
+    engines are templates over the machine type, so each memory size gets
+    its own code with the wrap folded in. They read memory through
+    load(memory(), address), which for this flat layout is a plain index.
+*/
+template <size_t MemWords>
+struct BasicMachine : MachineState
+{
+    static_assert(MemWords > 0 && MemWords <= REG_SIZE, "E20 addresses are 16 bits");
+    static const size_t mem_words = MemWords;
+    static const size_t num_banks = 1;
+    static const size_t NUM_PAGES = (MemWords + PAGE_WORDS - 1) / PAGE_WORDS;
+
+    uint16_t memory_arr[MemWords];
+    DirtyPages<NUM_PAGES> dirty; // pages written since reset() or load_image(); writing memory_arr directly does not count
+
+    // pc, registers and memory all start at 0
+    void reset()
+    {
+        reset_state();
+        memset(memory_arr, 0, sizeof(memory_arr));
+        dirty.clear();
+    }
+
+    static size_t wrap(size_t address) { return wrap_address<MemWords>(address); }
+
+    // Replaces all of memory with the mem_words words of image; no page is dirty after
+    void load_image(const uint16_t image[])
+    {
+        memcpy(memory_arr, image, sizeof(memory_arr));
+        dirty.clear();
+    }
+
+    // What the engines hold on to for load()
+    typedef const uint16_t* Memory;
+    Memory memory() const { return memory_arr; }
+
+    // Reads a word; address must already be wrapped
+    static uint16_t load(Memory memory, size_t address) { return memory[address]; }
+
+    /*
+        Compares memory with that of a machine loaded with the same image,
+        looking only at pages that either one has written since.
+
+        @return The first address at which other's memory differs, or mem_words if none
+    */
+    size_t first_difference(const BasicMachine& other) const
+    {
+        for (size_t p = 0; p < NUM_PAGES; p++)
+        {
+            if (!dirty.test(p) && !other.dirty.test(p))
+                continue;
+            const uint16_t* first = memory_arr + p * PAGE_WORDS;
+            const uint16_t* last = memory_arr + std::min((p + 1) * PAGE_WORDS, MemWords);
+            const uint16_t* differs = std::mismatch(first, last, other.memory_arr + p * PAGE_WORDS).first;
+            if (differs != last)
+                return differs - memory_arr;
+        }
+        return MemWords;
+    }
+
+    /*
+        The sw path. A flat memory just stores the word.
+
+        @return true if the store remapped memory, so that side tables
+            built from it (predecoded instructions) must be rebuilt
+    */
+    bool store(size_t address, uint16_t value)
+    {
+        memory_arr[address] = value;
+        dirty.mark(address);
+        return false;
+    }
+};
+
+/*
+    The standard E20 machine, 8192 words. A Machine holds all of its
+    memory inline (about 16 KB, and 128 KB for 64K-word and banked ones),
+    so the tools never put a machine, or a BasicEngineRun holding one, on
+    the stack: they keep it in a std::vector, which also lets worker
+    threads with small stacks run any memory size.
+*/
+typedef BasicMachine<MEM_SIZE> Machine;
+
+/*
+    A machine whose data outgrows the 16-bit address space. The lower half
+    of the address space is ordinary memory; the upper half, from
+    BANK_WORDS, is a window onto one of Banks banks of BANK_WORDS words,
+    chosen by a sw of the bank number to BANK_SELECT, the last word below
+    the window (which reads back as a normal word). The selected bank lives
+    in the window itself, so loads, stores and fetches cost what they do on
+    a flat 64K machine and only a switch copies memory.
+*/
+template <size_t Banks>
+struct BankedMachine : BasicMachine<REG_SIZE>
+{
+    static_assert(Banks >= 2, "one bank is just a flat 64K machine");
+    static const size_t BANK_WORDS = REG_SIZE / 2;
+    static const size_t BANK_SELECT = BANK_WORDS - 1;
+    static const size_t num_banks = Banks;
+
+    size_t bank; // the bank in the window
+    uint16_t banks_arr[Banks][BANK_WORDS]; // saved contents of the banks not in the window
+    DirtyPages<BANK_WORDS / PAGE_WORDS> bank_dirty[Banks]; // per bank, pages written through the window; dirty only sees the window
+
+    void reset()
+    {
+        BasicMachine<REG_SIZE>::reset();
+        bank = 0;
+        memset(banks_arr, 0, sizeof(banks_arr));
+        for (size_t b = 0; b < Banks; b++)
+            bank_dirty[b].clear();
+    }
+
+    void load_image(const uint16_t image[])
+    {
+        BasicMachine<REG_SIZE>::load_image(image);
+        for (size_t b = 0; b < Banks; b++)
+            bank_dirty[b].clear();
+    }
+
+    // The current contents of bank b, whether in the window or saved
+    const uint16_t* bank_words(size_t b) const { return b == bank ? memory_arr + BANK_WORDS : banks_arr[b]; }
+
+    bool store(size_t address, uint16_t value)
+    {
+        memory_arr[address] = value;
+        dirty.mark(address);
+        if (address >= BANK_WORDS)
+            bank_dirty[bank].mark(address - BANK_WORDS);
+        if (address != BANK_SELECT || value % Banks == bank)
+            return false;
+        memcpy(banks_arr[bank], memory_arr + BANK_WORDS, sizeof(banks_arr[bank]));
+        bank = value % Banks;
+        memcpy(memory_arr + BANK_WORDS, banks_arr[bank], sizeof(banks_arr[bank]));
+        for (size_t window = BANK_WORDS; window < REG_SIZE; window += PAGE_WORDS) // the whole window changed
+            dirty.mark(window);
+        return true;
+    }
+};
+
+/*
+    A machine whose memory is a table of PAGE_WORDS-word pages that copies
+    of the machine share. Copying one, as a checkpoint or snapshot does,
+    copies only the page pointers; the first sw to a page that another copy
+    still holds gives this machine a page of its own. Untouched pages all
+    share one zero page. Every load pays an extra indirection, so this
+    layout is for runs that take many snapshots; plain runs use the flat
+    BasicMachine.
+*/
+template <size_t MemWords>
+struct PagedMachine : MachineState
+{
+    static_assert(MemWords > 0 && MemWords <= REG_SIZE, "E20 addresses are 16 bits");
+    static const size_t mem_words = MemWords;
+    static const size_t num_banks = 1;
+    static const size_t NUM_PAGES = (MemWords + PAGE_WORDS - 1) / PAGE_WORDS;
+
+    struct Page
+    {
+        uint16_t words[PAGE_WORDS];
+    };
+
+    std::shared_ptr<Page> pages[NUM_PAGES];
+    DirtyPages<NUM_PAGES> dirty; // as for BasicMachine
+
+    void reset()
+    {
+        reset_state();
+        for (size_t p = 0; p < NUM_PAGES; p++)
+            pages[p] = zero_page();
+        dirty.clear();
+    }
+
+    static size_t wrap(size_t address) { return wrap_address<MemWords>(address); }
+
+    // Pages of image that are all zero stay on the shared zero page
+    void load_image(const uint16_t image[])
+    {
+        for (size_t p = 0; p < NUM_PAGES; p++)
+        {
+            size_t words = std::min(PAGE_WORDS, MemWords - p * PAGE_WORDS);
+            const uint16_t* first = image + p * PAGE_WORDS;
+            if (std::all_of(first, first + words, [](uint16_t word) { return word == 0; }))
+            {
+                pages[p] = zero_page();
+                continue;
+            }
+            pages[p] = std::make_shared<Page>();
+            memcpy(pages[p]->words, first, words * sizeof(uint16_t));
+        }
+        dirty.clear();
+    }
+
+    typedef const std::shared_ptr<Page>* Memory;
+    Memory memory() const { return pages; }
+
+    static uint16_t load(Memory memory, size_t address)
+    {
+        return memory[address / PAGE_WORDS]->words[address % PAGE_WORDS];
+    }
+
+    // As for BasicMachine; pages that the two machines share are equal without being compared
+    size_t first_difference(const PagedMachine& other) const
+    {
+        for (size_t p = 0; p < NUM_PAGES; p++)
+        {
+            if ((!dirty.test(p) && !other.dirty.test(p)) || pages[p] == other.pages[p])
+                continue;
+            for (size_t i = 0; i < PAGE_WORDS && p * PAGE_WORDS + i < MemWords; i++)
+            {
+                if (pages[p]->words[i] != other.pages[p]->words[i])
+                    return p * PAGE_WORDS + i;
+            }
+        }
+        return MemWords;
+    }
+
+    // Copies the page first if any other machine shares it
+    bool store(size_t address, uint16_t value)
+    {
+        std::shared_ptr<Page>& page = pages[address / PAGE_WORDS];
+        if (page.use_count() > 1)
+            page = std::make_shared<Page>(*page);
+        page->words[address % PAGE_WORDS] = value;
+        dirty.mark(address);
+        return false;
+    }
+
+private:
+    static const std::shared_ptr<Page>& zero_page()
+    {
+        static const std::shared_ptr<Page> zero = std::make_shared<Page>(Page());
+        return zero;
+    }
+};
+
+/*
+    Applies the machine's IllegalPolicy to the undefined instruction at pc.
+    Engines only reach this from their own undefined-instruction path, so
+    it costs valid instructions nothing.
+
+    @return STATUS_ILLEGAL if the machine must stop, else STATUS_RUNNING
+*/
+template <class M>
+inline Status raise_illegal(M& machine)
+{
+    switch (machine.illegal_policy)
+    {
+    case ILLEGAL_NOP:
+        machine.pc += 1;
+        return STATUS_RUNNING;
+    case ILLEGAL_TRAP:
+        machine.regs_arr[7] = machine.pc + 1;
+        machine.pc = machine.trap_vector;
+        return STATUS_RUNNING;
+    default:
+        return STATUS_ILLEGAL;
+    }
+}
+
+/*
+    Prints why a machine stopped without halting: an undefined instruction,
+    its step limit or its timeout. Prints nothing for a halted machine.
+
+    @param instruction The word at the machine's pc, for an illegal stop
+*/
+inline void report_stop(const MachineState& machine, uint16_t instruction, std::ostream& out)
+{
+    if (machine.status == STATUS_ILLEGAL)
+    {
+        out << "Illegal instruction 16'b";
+        for (int bit = 15; bit >= 0; bit--)
+            out << ((instruction >> bit) & 1);
+        out << " (opcode 0, function code " << (instruction & 15) << ") at pc " << machine.pc << std::endl;
+    }
+    else if (machine.status == STATUS_STEP_LIMIT)
+        out << "Step limit of " << machine.step_limit << " reached after " << machine.executed << " instructions; partial state follows" << std::endl;
+    else if (machine.status == STATUS_TIMEOUT)
+        out << "Timed out after " << machine.executed << " instructions; partial state follows" << std::endl;
+}
+
+template <class M>
+inline void report_stop(const M& machine, std::ostream& out)
+{
+    report_stop(machine, M::load(machine.memory(), M::wrap(machine.pc)), out);
+}
+
+/*
+    Checks the machine's step limit and timeout flag. Engines call this only
+    after control transfers (j, jal, jr, jeq) and, for straight-line code
+    that runs off the top of memory and wraps, whenever executed reaches a
+    multiple of the memory size; so the limits cost nothing per instruction and a
+    run stops at the end of the basic block in which it ran out.
+
+    @param executed Instructions executed since reset(), including this one
+    @return STATUS_STEP_LIMIT, STATUS_TIMEOUT or STATUS_RUNNING
+*/
+template <class M>
+inline Status poll_limits(const M& machine, size_t executed)
+{
+    if (executed >= machine.step_limit)
+        return STATUS_STEP_LIMIT;
+    if (machine.timeout != nullptr && machine.timeout->load(std::memory_order_relaxed))
+        return STATUS_TIMEOUT;
+    return STATUS_RUNNING;
+}
+
+/*
+    Prints the current state of the simulator, including
+    the current program counter, the current register values,
+    and the first memquantity elements of memory.
+
+    @param pc The final value of the program counter
+    @param regs Final value of all registers
+    @param memory Final value of memory
+    @param memquantity How many words of memory to dump
+    @param out Stream to print to
+*/
+inline void print_state(uint16_t pc, const uint16_t regs[], const uint16_t memory[], size_t memquantity, std::ostream &out = std::cout) {
+    out << std::setfill(' ');
+    out << "Final state:" << std::endl;
+    out << "\tpc=" <<std::setw(5)<< pc << std::endl;
+
+    for (size_t reg=0; reg<NUM_REGS; reg++)
+        out << "\t$" << reg << "="<<std::setw(5)<<regs[reg]<<std::endl;
+
+    out << std::setfill('0');
+    bool cr = false;
+    for (size_t count=0; count<memquantity; count++) {
+        out << std::hex << std::setw(4) << memory[count] << " ";
+        cr = true;
+        if (count % 8 == 7) {
+            out << std::endl;
+            cr = false;
+        }
+    }
+    if (cr)
+        out << std::endl;
+}
+
+// @return imm7 sign-extended to 16 bits
+constexpr uint16_t sign_extend7(uint16_t imm7)
+{
+    return (imm7 >> 6) == 1 ? imm7 | 65408 : imm7; //msb of the imm7 is set, aka is 1, so imm7 < 0; Sign extend
+}
+
+/*
+    Operations of the predecoded engine. OP_UNKNOWN covers the opcode 0
+    function codes that the ISA leaves undefined.
+*/
+enum Op : uint8_t
+{
+    OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT, OP_JR,
+    OP_ADDI, OP_J, OP_JAL, OP_LW, OP_SW, OP_JEQ, OP_SLTI,
+    OP_UNKNOWN
+};
+
+/*
+    One instruction word with its fields already extracted, so the
+    engines do no shifting, masking or sign extension.
+*/
+struct Decoded
+{
+    uint8_t op; // also the index of the threaded engine's handler
+    uint8_t reg_a; // bits10_12
+    uint8_t reg_b; // bits7_9
+    uint8_t reg_dst; // bits4_6
+    uint16_t imm; // sign-extended imm7, or imm13 for j and jal
+};
+
+constexpr bool operator==(const Decoded& a, const Decoded& b)
+{
+    return a.op == b.op && a.reg_a == b.reg_a && a.reg_b == b.reg_b && a.reg_dst == b.reg_dst && a.imm == b.imm;
+}
+
+// Extracts the fields of one word; decode() looks the result up instead
+constexpr Decoded decode_fields(uint16_t instruction)
+{
+    uint16_t opcode = instruction >> 13;
+    uint16_t bits0_3 = instruction & 15;
+    Decoded d = {OP_UNKNOWN, 0, 0, 0, 0};
+    d.reg_a = (instruction >> 10) & 7;
+    d.reg_b = (instruction >> 7) & 7;
+    d.reg_dst = (instruction >> 4) & 7;
+    d.imm = sign_extend7(instruction & 127);
+
+    const uint8_t opcode_ops[8] = {OP_UNKNOWN, OP_ADDI, OP_J, OP_JAL, OP_LW, OP_SW, OP_JEQ, OP_SLTI};
+    d.op = opcode_ops[opcode];
+    if (opcode == 0)
+    {
+        const uint8_t func_ops[16] = {
+            OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN,
+            OP_JR, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN
+        };
+        d.op = func_ops[bits0_3];
+    }
+    else if (opcode == 2 || opcode == 3) // j and jal take a 13-bit immediate
+    {
+        d.imm = instruction & 8191;
+    }
+    return d;
+}
+
+/*
+    Every 16-bit word already decoded, built by the compiler. The engines,
+    the reference interpreter and the timing models all decode through it.
+*/
+struct DecodeTable
+{
+    Decoded entries[REG_SIZE];
+
+    constexpr const Decoded& operator[](uint16_t instruction) const { return entries[instruction]; }
+};
+
+constexpr DecodeTable make_decode_table()
+{
+    DecodeTable table = {};
+    for (size_t instruction = 0; instruction < REG_SIZE; instruction++)
+        table.entries[instruction] = decode_fields(instruction);
+    return table;
+}
+
+inline constexpr DecodeTable decode_table = make_decode_table();
+
+/*
+    @return true if every entry of decode_table has the fields the E20
+        encoding gives it, worked out independently of decode_fields()
+*/
+constexpr bool decode_table_is_consistent()
+{
+    for (size_t instruction = 0; instruction < REG_SIZE; instruction++)
+    {
+        const Decoded& d = decode_table[instruction];
+        size_t opcode = instruction >> 13;
+        uint16_t imm7 = (uint16_t)((int16_t)(instruction << 9) >> 9); // the arithmetic shift sign-extends
+        bool jump = opcode == 2 || opcode == 3;
+        if (d.reg_a != ((instruction >> 10) & 7) || d.reg_b != ((instruction >> 7) & 7) || d.reg_dst != ((instruction >> 4) & 7))
+            return false;
+        if (d.imm != (jump ? instruction & 8191 : imm7))
+            return false;
+        if (opcode != 0 && d.op != OP_ADDI + opcode - 1)
+            return false;
+        if (opcode == 0 && (instruction & 15) <= 4 && d.op != (instruction & 15))
+            return false;
+        if (opcode == 0 && (instruction & 15) > 4 && d.op != ((instruction & 15) == 8 ? OP_JR : OP_UNKNOWN))
+            return false;
+    }
+    return true;
+}
+
+static_assert(decode_table_is_consistent(), "decode_table disagrees with the E20 encoding");
+static_assert(decode_table[0x0010].op == OP_ADD && decode_table[0x0010].reg_dst == 1, "add $1, $0, $0");
+static_assert(decode_table[0x1c08].op == OP_JR && decode_table[0x1c08].reg_a == 7, "jr $7");
+static_assert(decode_table[0x20ff].op == OP_ADDI && decode_table[0x20ff].reg_b == 1 && decode_table[0x20ff].imm == 0xffff, "addi $1, $0, -1");
+static_assert(decode_table[0x5fff].op == OP_J && decode_table[0x5fff].imm == 8191, "j 8191");
+static_assert(decode_table[0x0005].op == OP_UNKNOWN && decode_table[0xc07f].op == OP_JEQ, "undefined function code; jeq");
+
+inline Decoded decode(uint16_t instruction)
+{
+    return decode_table[instruction];
+}
+
+/*
+    Decodes every word of memory into decoded.
+
+    @param words Size of memory_arr and decoded
+*/
+inline void predecode(const uint16_t memory_arr[], Decoded decoded[], size_t words = MEM_SIZE)
+{
+    for (size_t i = 0; i < words; i++)
+        decoded[i] = decode(memory_arr[i]);
+}
+
+// Decodes all of a machine's memory, whatever its layout, into decoded
+template <class M>
+inline void predecode_machine(const M& machine, Decoded decoded[])
+{
+    typename M::Memory memory = machine.memory();
+    for (size_t i = 0; i < M::mem_words; i++)
+        decoded[i] = decode(M::load(memory, i));
+}
+
+/*
+    Predecoded engine: runs the same program as run_e20_simulator, but
+    dispatches on instructions decoded ahead of time. sw re-decodes the word
+    it writes, so self-modifying code behaves as in the reference loop.
+
+    @param machine The machine to run, updated in place
+    @param decoded predecode() of the machine's memory, kept in sync by sw
+    @param stop_pc If not -1, stop before executing the instruction at this pc
+    @param max_steps Stop after exactly this many instructions even if not
+        halted; unlike Machine::step_limit this is checked every instruction
+    @return The number of instructions executed
+*/
+template <class M>
+inline size_t run_predecoded(M& machine, Decoded decoded[], int stop_pc = -1, size_t max_steps = SIZE_MAX)
+{
+    const size_t words = M::mem_words;
+    uint16_t pc = machine.pc;
+    uint16_t* regs = machine.regs_arr;
+    typename M::Memory memory = machine.memory();
+    size_t steps = 0;
+    Status status = STATUS_RUNNING;
+    // the loop already compares steps every instruction, so bounding it by
+    // the next multiple of the memory size gives the wraparound poll for free
+    size_t slice_end = std::min(max_steps, words - machine.executed % words);
+
+    for (;;)
+    {
+        while (status == STATUS_RUNNING && pc != stop_pc && steps < slice_end)
+        {
+            steps++;
+            const Decoded d = decoded[M::wrap(pc)];
+            switch (d.op)
+            {
+            case OP_ADD:  regs[d.reg_dst] = regs[d.reg_a] + regs[d.reg_b]; pc += 1; break;
+            case OP_SUB:  regs[d.reg_dst] = regs[d.reg_a] - regs[d.reg_b]; pc += 1; break;
+            case OP_OR:   regs[d.reg_dst] = regs[d.reg_a] | regs[d.reg_b]; pc += 1; break;
+            case OP_AND:  regs[d.reg_dst] = regs[d.reg_a] & regs[d.reg_b]; pc += 1; break;
+            case OP_SLT:  regs[d.reg_dst] = regs[d.reg_a] < regs[d.reg_b]; pc += 1; break;
+            case OP_JR:   pc = regs[d.reg_a]; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_ADDI: regs[d.reg_b] = regs[d.reg_a] + d.imm; pc += 1; break;
+            case OP_J:
+                if (pc == d.imm) // jumping to itself halts
+                    status = STATUS_HALTED;
+                else
+                    status = poll_limits(machine, machine.executed + steps);
+                pc = d.imm;
+                break;
+            case OP_JAL:  regs[7] = pc + 1; pc = d.imm; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_LW:   regs[d.reg_b] = M::load(memory, M::wrap((uint16_t)(regs[d.reg_a] + d.imm))); pc += 1; break;
+            case OP_SW:
+            {
+                size_t address = M::wrap((uint16_t)(regs[d.reg_a] + d.imm));
+                if (machine.store(address, regs[d.reg_b]))
+                    predecode_machine(machine, decoded); // a bank switch replaced part of memory
+                else
+                    decoded[address] = decode(regs[d.reg_b]);
+                pc += 1;
+                break;
+            }
+            case OP_JEQ:  pc = (regs[d.reg_a] == regs[d.reg_b]) ? pc + 1 + d.imm : pc + 1; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_SLTI: regs[d.reg_b] = regs[d.reg_a] < d.imm; pc += 1; break;
+            default: // OP_UNKNOWN: the predecoder already classified this word as illegal
+                machine.pc = pc;
+                status = raise_illegal(machine);
+                pc = machine.pc;
+                break;
+            }
+            regs[0] = 0; //ensures that the zero register is always 0
+        }
+        if (status != STATUS_RUNNING || pc == stop_pc)
+            break;
+        if ((machine.executed + steps) % words == 0)
+            status = poll_limits(machine, machine.executed + steps);
+        if (status != STATUS_RUNNING || steps >= max_steps)
+            break;
+        slice_end = std::min(max_steps, steps + words);
+    }
+    machine.pc = pc;
+    machine.status = status;
+    machine.executed += steps;
+    return steps;
+}
+
+/*
+    Operations that only appear in compiled traces, numbered after Op.
+*/
+enum TraceOnlyOp : uint8_t
+{
+    TOP_ORI = OP_UNKNOWN + 1, // regs[reg_b] = regs[reg_a] | imm
+    TOP_ANDI, // regs[reg_b] = regs[reg_a] & imm
+    TOP_JEQI, // guard: (regs[reg_a] == imm) must equal taken
+    TOP_NOP // a control transfer whose direction is fixed; only polls
+};
+
+/*
+    One instruction of a compiled trace. Registers that the trace never
+    writes are loop invariants: their values are folded into imm, so the
+    loop body reads them from no register at all (constant operands become
+    $0-based, since $0 is always 0).
+*/
+struct TraceOp
+{
+    Decoded d; // op may be a TraceOnlyOp
+    uint16_t pc; // address of the original instruction
+    uint16_t next_pc; // pc after it along the recorded path
+    uint16_t exit_pc; // for a jeq guard, pc when it fails (a jr guard exits to its register's value)
+    bool taken; // for a jeq guard, the recorded direction
+    bool transfer; // a control transfer, so the limits are polled after it
+};
+
+/*
+    A hot loop compiled into one straight-line trace, from its head (the
+    target of a taken back edge) around to the head again.
+*/
+struct Trace
+{
+    uint16_t head;
+    std::vector<TraceOp> ops;
+    uint8_t invariant = 0; // bit r set if $r is specialized into the trace
+    uint16_t values[NUM_REGS]; // the specialized registers' values, checked on entry
+    size_t entry_misses = 0; // entries refused because an invariant changed
+};
+
+/*
+    The tracing engine's side tables: back-edge counters, the trace being
+    recorded, and the compiled traces by head.
+*/
+struct TraceCache
+{
+    static const size_t HOT = 64; // taken back edges to a pc before its loop is recorded
+    static const size_t MAX_TRACE = 256; // longest path recorded before giving up
+
+    std::vector<uint16_t> counters; // per word, taken back edges to it
+    std::vector<uint16_t> counted; // words whose counter has left 0, for clear()
+    std::vector<int> trace_at; // per word, index into traces of the trace headed there, or -1
+    std::vector<uint8_t> in_trace; // per word, part of a compiled trace; a sw to it flushes them all
+    std::vector<Trace> traces;
+    std::vector<TraceOp> recording; // the path so far while recording
+    int recording_head = -1; // -1 when not recording
+
+    void reset(size_t words)
+    {
+        counters.assign(words, 0);
+        counted.clear();
+        trace_at.assign(words, -1);
+        in_trace.assign(words, 0);
+        traces.clear();
+        recording.clear();
+        recording_head = -1;
+    }
+
+    // Drops every trace, as self-modifying code may have changed any of them
+    void flush()
+    {
+        std::fill(trace_at.begin(), trace_at.end(), -1);
+        std::fill(in_trace.begin(), in_trace.end(), 0);
+        std::fill(counters.begin(), counters.end(), 0);
+        counted.clear();
+        traces.clear();
+        recording.clear();
+        recording_head = -1;
+    }
+
+    /*
+        Like reset() on the same memory size, but touches only the words
+        that were counted or compiled since, so that many short runs can
+        share one cache cheaply.
+    */
+    template <class M>
+    void clear()
+    {
+        for (size_t i = 0; i < counted.size(); i++)
+            counters[counted[i]] = 0;
+        for (size_t t = 0; t < traces.size(); t++)
+        {
+            trace_at[M::wrap(traces[t].head)] = -1;
+            for (size_t i = 0; i < traces[t].ops.size(); i++)
+                in_trace[M::wrap(traces[t].ops[i].pc)] = 0;
+        }
+        counted.clear();
+        traces.clear();
+        recording.clear();
+        recording_head = -1;
+    }
+
+    /*
+        Abandons the recording if a sw just rewrote an instruction already
+        on its path, which would otherwise be compiled as it was before.
+        in_trace only covers compiled traces.
+    */
+    template <class M>
+    void stored(size_t address)
+    {
+        for (size_t i = 0; i < recording.size(); i++)
+        {
+            if (M::wrap(recording[i].pc) == address)
+            {
+                recording.clear();
+                recording_head = -1;
+                return;
+            }
+        }
+    }
+
+    /*
+        Appends one executed instruction to the recording, compiling the
+        trace once the path is back at its head. Paths through a halt or
+        an undefined instruction, and overlong ones, are abandoned. A jr is
+        kept, guarded on the target it returned to this time: the return
+        address that the recorded jal (or the caller around the loop)
+        pushed, which is what a return-address stack would predict.
+
+        @param decoded The engine's predecoded memory, which compile()
+            checks the recorded instructions against
+    */
+    template <class M>
+    void record(const Decoded& d, uint16_t from, uint16_t to, const M& machine, const Decoded decoded[])
+    {
+        bool halt = d.op == OP_J && d.imm == from;
+        if (d.op == OP_UNKNOWN || halt || recording.size() == MAX_TRACE)
+        {
+            recording.clear();
+            recording_head = -1;
+            return;
+        }
+        TraceOp op;
+        op.d = d;
+        op.pc = from;
+        op.next_pc = to;
+        op.taken = d.op == OP_JEQ && to != (uint16_t)(from + 1);
+        op.exit_pc = op.taken ? from + 1 : from + 1 + d.imm;
+        op.transfer = d.op == OP_J || d.op == OP_JAL || d.op == OP_JEQ || d.op == OP_JR;
+        recording.push_back(op);
+        if (to == recording_head)
+            compile(machine, decoded);
+    }
+
+private:
+    template <class M>
+    void compile(const M& machine, const Decoded decoded[])
+    {
+        for (size_t i = 0; i < recording.size(); i++)
+        {
+            if (!(recording[i].d == decoded[M::wrap(recording[i].pc)])) // stale; stored() should have caught it
+            {
+                recording.clear();
+                recording_head = -1;
+                return;
+            }
+        }
+        Trace trace;
+        trace.head = recording_head;
+        uint8_t written = 0;
+        for (size_t i = 0; i < recording.size(); i++)
+        {
+            const Decoded& d = recording[i].d;
+            if (d.op <= OP_SLT)
+                written |= 1 << d.reg_dst;
+            else if (d.op == OP_ADDI || d.op == OP_SLTI || d.op == OP_LW)
+                written |= 1 << d.reg_b;
+            else if (d.op == OP_JAL)
+                written |= 1 << 7;
+        }
+        trace.invariant = ~written | 1; // $0 is always invariant
+        std::copy(machine.regs_arr, machine.regs_arr + NUM_REGS, trace.values); // invariants still hold their entry values
+        trace.values[0] = 0;
+        for (size_t i = 0; i < recording.size(); i++)
+        {
+            TraceOp op = recording[i];
+            specialize(op, trace);
+            trace.ops.push_back(op);
+            in_trace[M::wrap(op.pc)] = 1;
+        }
+        trace_at[M::wrap(trace.head)] = traces.size();
+        traces.push_back(trace);
+        recording.clear();
+        recording_head = -1;
+    }
+
+    // Rewrites op so that it reads no invariant register
+    static void specialize(TraceOp& op, const Trace& trace)
+    {
+        Decoded& d = op.d;
+        bool a = (trace.invariant >> d.reg_a) & 1;
+        bool b = (trace.invariant >> d.reg_b) & 1;
+        uint16_t va = trace.values[d.reg_a];
+        uint16_t vb = trace.values[d.reg_b];
+        auto constant = [&](uint8_t dest, uint16_t value) { d.op = OP_ADDI; d.reg_b = dest; d.reg_a = 0; d.imm = value; };
+        auto with_imm = [&](uint8_t op_imm, uint8_t dest, uint8_t source, uint16_t value) { d.op = op_imm; d.reg_b = dest; d.reg_a = source; d.imm = value; };
+        switch (d.op)
+        {
+        case OP_ADD:
+            if (a && b) constant(d.reg_dst, va + vb);
+            else if (b) with_imm(OP_ADDI, d.reg_dst, d.reg_a, vb);
+            else if (a) with_imm(OP_ADDI, d.reg_dst, d.reg_b, va);
+            break;
+        case OP_SUB:
+            if (a && b) constant(d.reg_dst, va - vb);
+            else if (b) with_imm(OP_ADDI, d.reg_dst, d.reg_a, -vb);
+            break;
+        case OP_OR:
+            if (a && b) constant(d.reg_dst, va | vb);
+            else if (b) with_imm(TOP_ORI, d.reg_dst, d.reg_a, vb);
+            else if (a) with_imm(TOP_ORI, d.reg_dst, d.reg_b, va);
+            break;
+        case OP_AND:
+            if (a && b) constant(d.reg_dst, va & vb);
+            else if (b) with_imm(TOP_ANDI, d.reg_dst, d.reg_a, vb);
+            else if (a) with_imm(TOP_ANDI, d.reg_dst, d.reg_b, va);
+            break;
+        case OP_SLT:
+            if (a && b) constant(d.reg_dst, va < vb);
+            else if (b) with_imm(OP_SLTI, d.reg_dst, d.reg_a, vb);
+            break;
+        case OP_ADDI:
+            if (a) constant(d.reg_b, va + d.imm);
+            break;
+        case OP_SLTI:
+            if (a) constant(d.reg_b, va < d.imm);
+            break;
+        case OP_LW:
+        case OP_SW:
+            if (a)
+            {
+                d.imm = va + d.imm; // a fixed address
+                d.reg_a = 0;
+            }
+            break;
+        case OP_JEQ:
+            if (a && b) d.op = TOP_NOP; // the direction cannot change
+            else if (a) with_imm(TOP_JEQI, d.reg_b, d.reg_b, va);
+            else if (b) with_imm(TOP_JEQI, d.reg_b, d.reg_a, vb);
+            break;
+        case OP_J:
+            d.op = TOP_NOP;
+            break;
+        case OP_JR:
+            if (a) d.op = TOP_NOP; // an invariant register always holds the recorded target
+            break;
+        case OP_JAL:
+            constant(7, op.pc + 1);
+            break;
+        }
+    }
+};
+
+/*
+    Tracing engine: the predecoded engine, which also counts taken back
+    edges (a j or jeq to its own pc or below). Once a loop head is hot,
+    the next trip around it is recorded and compiled into a Trace; from
+    then on, arriving at the head runs whole iterations of the trace for
+    as long as its jeq and jr guards hold, and a failing guard side-exits
+    to the interpreter at the other target. Steps, polls and the final state are
+    exactly those of the reference interpreter: an iteration only starts
+    when it fits in the current poll slice, and every control transfer in
+    it polls the limits.
+
+    @param decoded predecode() of the machine's memory, kept in sync by sw
+    @param traces reset() to the memory size before the first run; kept
+        between runs so a resumed run keeps its traces
+    @param max_steps As for run_predecoded()
+    @return The number of instructions executed
+*/
+template <class M>
+inline size_t run_traced(M& machine, Decoded decoded[], TraceCache& traces, size_t max_steps = SIZE_MAX)
+{
+    const size_t words = M::mem_words;
+    uint16_t pc = machine.pc;
+    uint16_t* regs = machine.regs_arr;
+    typename M::Memory memory = machine.memory();
+    size_t steps = 0;
+    Status status = STATUS_RUNNING;
+    size_t slice_end = std::min(max_steps, words - machine.executed % words);
+
+    // sw, in and out of traces; @return true if traces had to be flushed
+    auto store = [&](size_t address, uint16_t value) {
+        if (machine.store(address, value))
+        {
+            predecode_machine(machine, decoded);
+            traces.flush();
+            return true;
+        }
+        decoded[address] = decode(value);
+        if (traces.recording_head >= 0)
+            traces.stored<M>(address);
+        if (!traces.in_trace[address])
+            return false;
+        traces.flush();
+        return true;
+    };
+
+    for (;;)
+    {
+        while (status == STATUS_RUNNING && steps < slice_end)
+        {
+            steps++;
+            uint16_t from = pc;
+            const Decoded d = decoded[M::wrap(pc)];
+            switch (d.op)
+            {
+            case OP_ADD:  regs[d.reg_dst] = regs[d.reg_a] + regs[d.reg_b]; pc += 1; break;
+            case OP_SUB:  regs[d.reg_dst] = regs[d.reg_a] - regs[d.reg_b]; pc += 1; break;
+            case OP_OR:   regs[d.reg_dst] = regs[d.reg_a] | regs[d.reg_b]; pc += 1; break;
+            case OP_AND:  regs[d.reg_dst] = regs[d.reg_a] & regs[d.reg_b]; pc += 1; break;
+            case OP_SLT:  regs[d.reg_dst] = regs[d.reg_a] < regs[d.reg_b]; pc += 1; break;
+            case OP_JR:   pc = regs[d.reg_a]; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_ADDI: regs[d.reg_b] = regs[d.reg_a] + d.imm; pc += 1; break;
+            case OP_J:
+                if (pc == d.imm) // jumping to itself halts
+                    status = STATUS_HALTED;
+                else
+                    status = poll_limits(machine, machine.executed + steps);
+                pc = d.imm;
+                break;
+            case OP_JAL:  regs[7] = pc + 1; pc = d.imm; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_LW:   regs[d.reg_b] = M::load(memory, M::wrap((uint16_t)(regs[d.reg_a] + d.imm))); pc += 1; break;
+            case OP_SW:   store(M::wrap((uint16_t)(regs[d.reg_a] + d.imm)), regs[d.reg_b]); pc += 1; break;
+            case OP_JEQ:  pc = (regs[d.reg_a] == regs[d.reg_b]) ? pc + 1 + d.imm : pc + 1; status = poll_limits(machine, machine.executed + steps); break;
+            case OP_SLTI: regs[d.reg_b] = regs[d.reg_a] < d.imm; pc += 1; break;
+            default: // OP_UNKNOWN: the predecoder already classified this word as illegal
+                machine.pc = pc;
+                status = raise_illegal(machine);
+                pc = machine.pc;
+                break;
+            }
+            regs[0] = 0; //ensures that the zero register is always 0
+
+            if (traces.recording_head >= 0)
+                traces.record(d, from, pc, machine, decoded);
+            if (status != STATUS_RUNNING || (d.op != OP_J && d.op != OP_JEQ) || pc > from)
+                continue;
+
+            // a taken back edge: run the loop's trace, or count towards recording one
+            size_t head = M::wrap(pc);
+            if (traces.recording_head >= 0) // the recording must see every instruction
+                continue;
+            if (traces.trace_at[head] < 0)
+            {
+                if (traces.counters[head]++ == 0)
+                    traces.counted.push_back(head);
+                if (traces.counters[head] >= TraceCache::HOT)
+                {
+                    traces.counters[head] = 0;
+                    traces.recording_head = pc;
+                }
+                continue;
+            }
+            Trace& trace = traces.traces[traces.trace_at[head]];
+            bool specialized = trace.head == pc;
+            for (size_t r = 1; r < NUM_REGS && specialized; r++)
+                specialized = !((trace.invariant >> r) & 1) || regs[r] == trace.values[r];
+            if (!specialized)
+            {
+                if (++trace.entry_misses >= TraceCache::HOT) // the invariants have moved on; record the loop afresh
+                    traces.trace_at[head] = -1;
+                continue;
+            }
+            const TraceOp* ops = trace.ops.data();
+            size_t length = trace.ops.size();
+            bool leave = false;
+            while (!leave && steps + length <= slice_end)
+            {
+                for (size_t i = 0; i < length; i++)
+                {
+                    const TraceOp op = ops[i]; // a copy: a sw to the trace's own code flushes it
+                    const Decoded& t = op.d;
+                    steps++;
+                    bool exit = false;
+                    switch (t.op)
+                    {
+                    case OP_ADD:  regs[t.reg_dst] = regs[t.reg_a] + regs[t.reg_b]; break;
+                    case OP_SUB:  regs[t.reg_dst] = regs[t.reg_a] - regs[t.reg_b]; break;
+                    case OP_OR:   regs[t.reg_dst] = regs[t.reg_a] | regs[t.reg_b]; break;
+                    case OP_AND:  regs[t.reg_dst] = regs[t.reg_a] & regs[t.reg_b]; break;
+                    case OP_SLT:  regs[t.reg_dst] = regs[t.reg_a] < regs[t.reg_b]; break;
+                    case OP_ADDI: regs[t.reg_b] = regs[t.reg_a] + t.imm; break;
+                    case OP_SLTI: regs[t.reg_b] = regs[t.reg_a] < t.imm; break;
+                    case TOP_ORI: regs[t.reg_b] = regs[t.reg_a] | t.imm; break;
+                    case TOP_ANDI: regs[t.reg_b] = regs[t.reg_a] & t.imm; break;
+                    case OP_LW:   regs[t.reg_b] = M::load(memory, M::wrap((uint16_t)(regs[t.reg_a] + t.imm))); break;
+                    case OP_SW:   leave = store(M::wrap((uint16_t)(regs[t.reg_a] + t.imm)), regs[t.reg_b]); break;
+                    case OP_JEQ:  exit = (regs[t.reg_a] == regs[t.reg_b]) != op.taken; break;
+                    case TOP_JEQI: exit = (regs[t.reg_a] == t.imm) != op.taken; break;
+                    case OP_JR:   exit = regs[t.reg_a] != op.next_pc; break;
+                    default: break; // TOP_NOP
+                    }
+                    regs[0] = 0;
+                    if (exit)
+                        pc = t.op == OP_JR ? regs[t.reg_a] : op.exit_pc;
+                    else
+                        pc = op.next_pc;
+                    if (op.transfer)
+                        status = poll_limits(machine, machine.executed + steps);
+                    if (exit || leave || status != STATUS_RUNNING)
+                    {
+                        leave = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (status != STATUS_RUNNING)
+            break;
+        if ((machine.executed + steps) % words == 0)
+            status = poll_limits(machine, machine.executed + steps);
+        if (status != STATUS_RUNNING || steps >= max_steps)
+            break;
+        slice_end = std::min(max_steps, steps + words);
+    }
+    machine.pc = pc;
+    machine.status = status;
+    machine.executed += steps;
+    return steps;
+}
+
+// A guaranteed tail call, where the compiler has one
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define E20_MUSTTAIL [[clang::musttail]]
+#elif __has_cpp_attribute(gnu::musttail)
+#define E20_MUSTTAIL [[gnu::musttail]]
+#endif
+#endif
+
+#ifdef E20_MUSTTAIL
+size_t const static THREADED_CHAIN = SIZE_MAX;
+#else
+// Without musttail a handler's tail call is only as good as the optimizer
+// (and at -O0 every handler takes a stack frame), so a chain of handlers
+// returns to the driver after this many instructions.
+#define E20_MUSTTAIL
+size_t const static THREADED_CHAIN = 1024;
+#endif
+
+/*
+    Handlers of the tail-call threaded engine, one per Op. Each executes
+    one instruction and ends by calling the handler of the next, looked up
+    in the predecoded table. The state that changes from one instruction
+    to the next travels in arguments so that the compiler keeps it in host
+    registers; a chain returns to run_threaded() when it stops the machine
+    or its step budget runs out.
+*/
+template <class M>
+struct ThreadedEngine
+{
+    // What the handlers of one run share
+    struct Context
+    {
+        M& machine;
+        Decoded* decoded;
+        size_t chain_end; // return to the driver once steps reaches this
+        Status status;
+        uint16_t pc; // where the last chain stopped
+        size_t steps; // instructions executed by the run when the last chain stopped
+    };
+
+    /*
+        @param d &decoded[pc]
+        @param steps Instructions executed by the run, including this one
+    */
+    typedef void (*Handler)(Context& c, const Decoded* d, uint16_t pc, uint16_t* regs, typename M::Memory memory, size_t steps);
+
+    static const Handler handlers[OP_UNKNOWN + 1];
+
+#define E20_HANDLER(name) \
+    static void name(Context& c, const Decoded* d, uint16_t pc, uint16_t* regs, typename M::Memory memory, size_t steps)
+#define E20_LEAVE(next) \
+    do { c.pc = (next); c.steps = steps; return; } while (0)
+#define E20_NEXT(next) \
+    do { \
+        pc = (next); \
+        if (steps >= c.chain_end) \
+            E20_LEAVE(pc); \
+        d = &c.decoded[M::wrap(pc)]; \
+        E20_MUSTTAIL return handlers[d->op](c, d, pc, regs, memory, steps + 1); \
+    } while (0)
+// a control transfer polls the limits before going on
+#define E20_TRANSFER(next) \
+    do { \
+        c.status = poll_limits(c.machine, c.machine.executed + steps); \
+        if (c.status != STATUS_RUNNING) \
+            E20_LEAVE(next); \
+        E20_NEXT(next); \
+    } while (0)
+
+    E20_HANDLER(op_add)  { regs[d->reg_dst] = regs[d->reg_a] + regs[d->reg_b]; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_sub)  { regs[d->reg_dst] = regs[d->reg_a] - regs[d->reg_b]; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_or)   { regs[d->reg_dst] = regs[d->reg_a] | regs[d->reg_b]; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_and)  { regs[d->reg_dst] = regs[d->reg_a] & regs[d->reg_b]; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_slt)  { regs[d->reg_dst] = regs[d->reg_a] < regs[d->reg_b]; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_jr)   { E20_TRANSFER(regs[d->reg_a]); }
+    E20_HANDLER(op_addi) { regs[d->reg_b] = regs[d->reg_a] + d->imm; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_j)
+    {
+        if (pc == d->imm) // jumping to itself halts
+        {
+            c.status = STATUS_HALTED;
+            E20_LEAVE(pc);
+        }
+        E20_TRANSFER(d->imm);
+    }
+    E20_HANDLER(op_jal)  { regs[7] = pc + 1; E20_TRANSFER(d->imm); }
+    E20_HANDLER(op_lw)   { regs[d->reg_b] = M::load(memory, M::wrap((uint16_t)(regs[d->reg_a] + d->imm))); regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_sw)
+    {
+        size_t address = M::wrap((uint16_t)(regs[d->reg_a] + d->imm));
+        if (c.machine.store(address, regs[d->reg_b]))
+            predecode_machine(c.machine, c.decoded); // a bank switch replaced part of memory
+        else
+            c.decoded[address] = decode(regs[d->reg_b]);
+        E20_NEXT(pc + 1);
+    }
+    E20_HANDLER(op_jeq)  { E20_TRANSFER(regs[d->reg_a] == regs[d->reg_b] ? pc + 1 + d->imm : pc + 1); }
+    E20_HANDLER(op_slti) { regs[d->reg_b] = regs[d->reg_a] < d->imm; regs[0] = 0; E20_NEXT(pc + 1); }
+    E20_HANDLER(op_unknown) // the predecoder already classified this word as illegal
+    {
+        c.machine.pc = pc;
+        c.status = raise_illegal(c.machine);
+        if (c.status != STATUS_RUNNING)
+            E20_LEAVE(pc);
+        E20_NEXT(c.machine.pc);
+    }
+
+#undef E20_HANDLER
+#undef E20_LEAVE
+#undef E20_NEXT
+#undef E20_TRANSFER
+};
+
+template <class M>
+const typename ThreadedEngine<M>::Handler ThreadedEngine<M>::handlers[OP_UNKNOWN + 1] = {
+    op_add, op_sub, op_or, op_and, op_slt, op_jr,
+    op_addi, op_j, op_jal, op_lw, op_sw, op_jeq, op_slti,
+    op_unknown
+};
+
+/*
+    Tail-call threaded engine: runs the same program as run_predecoded(),
+    but each instruction's handler jumps straight to the next one's instead
+    of returning to a central switch. Between chains, this driver does the
+    wraparound poll at multiples of the memory size, as the other engines do.
+
+    @param decoded predecode() of the machine's memory, kept in sync by sw
+    @param max_steps As for run_predecoded()
+    @return The number of instructions executed
+*/
+template <class M>
+inline size_t run_threaded(M& machine, Decoded decoded[], size_t max_steps = SIZE_MAX)
+{
+    typedef ThreadedEngine<M> Threaded;
+    const size_t words = M::mem_words;
+    typename Threaded::Context c = {machine, decoded, 0, STATUS_RUNNING, machine.pc, 0};
+    size_t slice_end = std::min(max_steps, words - machine.executed % words);
+
+    for (;;)
+    {
+        while (c.status == STATUS_RUNNING && c.steps < slice_end)
+        {
+            c.chain_end = slice_end - c.steps > THREADED_CHAIN ? c.steps + THREADED_CHAIN : slice_end;
+            const Decoded* d = &decoded[M::wrap(c.pc)];
+            Threaded::handlers[d->op](c, d, c.pc, machine.regs_arr, machine.memory(), c.steps + 1);
+        }
+        if (c.status != STATUS_RUNNING)
+            break;
+        if ((machine.executed + c.steps) % words == 0)
+            c.status = poll_limits(machine, machine.executed + c.steps);
+        if (c.status != STATUS_RUNNING || c.steps >= max_steps)
+            break;
+        slice_end = std::min(max_steps, c.steps + words);
+    }
+    machine.pc = c.pc;
+    machine.status = c.status;
+    machine.executed += c.steps;
+    return c.steps;
+}
+
+/*
+    Executes the single instruction at pc. This is the reference
+    interpreter: every other engine must match it exactly.
+
+    @param machine The machine, updated in place
+    @return STATUS_HALTED after a halt (a j to itself), STATUS_ILLEGAL if an
+        undefined instruction stops the machine, the poll_limits() status
+        after a control transfer, else STATUS_RUNNING
+*/
+template <class M>
+inline Status step_e20(M& machine) {
+    uint16_t* regs_arr = machine.regs_arr;
+    uint16_t& pc = machine.pc;
+    typename M::Memory memory = machine.memory();
+    Status status = STATUS_RUNNING;
+    machine.executed++;
+    size_t index = M::wrap(pc); // pc is 16-bit unsigned integer and memory may be smaller; this always makes sure index < M::mem_words. If pc is past the end, it wraps around to 0
+    uint16_t instruction = M::load(memory, index); //indexes memory at index; will never be out of range due to line above, and will always loop over and over without a problem
+
+
+    //Look up all possible combinations, already extracted in decode_table
+    const Decoded& fields = decode_table[instruction];
+    uint16_t opcode = instruction >> 13;
+    uint16_t bits10_12 = fields.reg_a;
+    uint16_t bits7_9 = fields.reg_b;
+    uint16_t bits4_6 = fields.reg_dst;
+    uint16_t bits0_3 = instruction & 15;
+    uint16_t bits0_6 = fields.imm; // sign-extended imm7, but for j and jal...
+    uint16_t bits0_12 = fields.imm; // ...the 13-bit target
+
+    if (opcode == 0) //add, sub, or, and, slt, jr, 
+    {
+        if (bits0_3 == 0) //add
+        {
+            regs_arr[bits4_6] = regs_arr[bits10_12] + regs_arr[bits7_9];
+            pc+=1;
+        }
+
+        else if (bits0_3 == 1) //sub
+        {
+            regs_arr[bits4_6] = regs_arr[bits10_12] - regs_arr[bits7_9];
+            pc+=1;
+        }
+        
+        else if (bits0_3 == 2) //or
+        {
+            regs_arr[bits4_6] = regs_arr[bits10_12] | regs_arr[bits7_9];
+            pc+=1;
+        }
+
+        else if (bits0_3 == 3) //and
+        {
+            regs_arr[bits4_6] = regs_arr[bits10_12] & regs_arr[bits7_9];
+            pc+=1;
+        }
+
+        else if (bits0_3 == 4) //slt
+        {
+            if (regs_arr[bits10_12] < regs_arr[bits7_9])
+            {
+                regs_arr[bits4_6] = 1;
+            }
+            else
+            {
+                regs_arr[bits4_6] = 0;
+            }
+            pc+=1;
+        }
+
+        else if (bits0_3 == 8) //jr
+        {
+            pc = regs_arr[bits10_12];
+            status = poll_limits(machine, machine.executed);
+        }
+
+        else // undefined function code
+        {
+            status = raise_illegal(machine);
+        }
+
+        regs_arr[0] = 0; //ensures that the zero register is always 0
+    }
+
+    else if (opcode == 1) //addi
+    {
+        regs_arr[bits7_9] = regs_arr[bits10_12] + bits0_6;
+        regs_arr[0] = 0; //ensures that the zero register is always 0
+        pc+=1;
+    }
+
+    else if (opcode == 2) //j
+    {
+        if (pc == bits0_12) //if pc will jump to itself
+        {
+            status = STATUS_HALTED; //set status to halted to stop loop
+        }
+        else
+        {
+            status = poll_limits(machine, machine.executed);
+        }
+        pc = bits0_12;
+    }
+
+    else if (opcode == 3) //jal
+    {
+        regs_arr[7] = pc + 1;
+        pc = bits0_12;
+        status = poll_limits(machine, machine.executed);
+    }
+
+    else if (opcode == 4) //lw
+    {
+        size_t address = M::wrap((uint16_t)(regs_arr[bits10_12] + bits0_6));
+        regs_arr[bits7_9] = M::load(memory, address);
+        regs_arr[0] = 0; //ensures that the zero register is always 0
+        pc+=1;
+    }
+
+    else if (opcode == 5) //sw
+    {
+        size_t address = M::wrap((uint16_t)(regs_arr[bits10_12] + bits0_6));
+        machine.store(address, regs_arr[bits7_9]);
+        pc+=1;
+    }
+
+    else if (opcode == 6) //jeq
+    {
+        if (regs_arr[bits10_12] == regs_arr[bits7_9])
+        {
+            pc = pc + 1 + bits0_6;
+        }
+        else
+        {
+            pc+=1;
+        }
+        status = poll_limits(machine, machine.executed);
+    }
+
+    else if (opcode == 7) //slti
+    {
+        if (regs_arr[bits10_12] < bits0_6)
+        {
+            regs_arr[bits7_9] = 1;
+        }
+        else
+        {
+            regs_arr[bits7_9] = 0;
+        }
+        regs_arr[0] = 0;
+        pc+=1;
+    }
+
+    return status;
+}
+
+/*
+    Runs the E20 program held in the machine's memory on the reference
+    interpreter until it halts or stops.
+
+    @param machine The machine, updated in place; its status says why it stopped
+    @param max_steps Stop after exactly this many instructions even if not halted
+    @return The number of instructions executed, including the halt
+*/
+template <class M>
+inline size_t run_e20_simulator(M& machine, size_t max_steps = SIZE_MAX) {
+    size_t steps = 0;
+    Status status = STATUS_RUNNING;
+
+    while (status == STATUS_RUNNING && steps < max_steps)
+    {
+        steps++;
+        status = step_e20(machine);
+        if (status == STATUS_RUNNING && machine.executed % M::mem_words == 0) // straight-line code can wrap around memory without a control transfer
+            status = poll_limits(machine, machine.executed);
+    }
+
+    machine.status = status;
+    return steps;
+}
+
+/*
+    The execution engines, selectable by name. Every engine must leave a
+    machine in exactly the state the reference interpreter would.
+*/
+enum Engine
+{
+    ENGINE_REFERENCE,
+    ENGINE_PREDECODED,
+    ENGINE_TRACE,
+    ENGINE_THREADED,
+    NUM_ENGINES
+};
+
+inline const char* engine_name(Engine engine)
+{
+    static const char* names[NUM_ENGINES] = {"reference", "predecoded", "trace", "threaded"};
+    return names[engine];
+}
+
+// @return false if name is not an engine
+inline bool parse_engine(const std::string& name, Engine& engine)
+{
+    for (int e = 0; e < NUM_ENGINES; e++)
+    {
+        if (name == engine_name((Engine)e))
+        {
+            engine = (Engine)e;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    A machine together with whatever side tables its engine keeps, so that
+    any engine can be started, paused at a step budget, copied as a
+    checkpoint and resumed.
+*/
+template <class M>
+struct BasicEngineRun
+{
+    Engine engine;
+    M machine;
+    std::vector<Decoded> decoded; // all but the reference engine
+    TraceCache traces; // trace engine only
+
+    // Call once machine holds the loaded program
+    void prepare()
+    {
+        if (engine != ENGINE_REFERENCE)
+        {
+            decoded.resize(M::mem_words);
+            predecode_machine(machine, decoded.data());
+        }
+        if (engine == ENGINE_TRACE)
+            traces.reset(M::mem_words);
+    }
+
+    // @return The number of instructions executed
+    size_t run(size_t max_steps = SIZE_MAX)
+    {
+        switch (engine)
+        {
+        case ENGINE_PREDECODED: return run_predecoded(machine, decoded.data(), -1, max_steps);
+        case ENGINE_TRACE: return run_traced(machine, decoded.data(), traces, max_steps);
+        case ENGINE_THREADED: return run_threaded(machine, decoded.data(), max_steps);
+        default: return run_e20_simulator(machine, max_steps);
+        }
+    }
+};
+
+typedef BasicEngineRun<Machine> EngineRun;
+
+/*
+    Describes the first difference between a reference run and a candidate
+    engine's run of the same image, or returns an empty string if they are
+    in the same state. Memory is compared only where either has written.
+*/
+template <class M>
+inline std::string compare_runs(const BasicEngineRun<M>& reference, size_t reference_steps, const BasicEngineRun<M>& candidate, size_t candidate_steps)
+{
+    const M& expected = reference.machine;
+    const M& actual = candidate.machine;
+    typename M::Memory expected_memory = expected.memory();
+    typename M::Memory actual_memory = actual.memory();
+    size_t addr = expected.first_difference(actual);
+
+    std::ostringstream out;
+    if (reference_steps != candidate_steps)
+        out << "steps: reference " << reference_steps << ", candidate " << candidate_steps;
+    else if (expected.status != actual.status)
+        out << "status: reference " << status_name(expected.status) << ", candidate " << status_name(actual.status);
+    else if (expected.pc != actual.pc)
+        out << "pc: reference " << expected.pc << ", candidate " << actual.pc;
+    else if (memcmp(expected.regs_arr, actual.regs_arr, sizeof(expected.regs_arr)) != 0)
+    {
+        size_t reg = 0;
+        while (expected.regs_arr[reg] == actual.regs_arr[reg])
+            reg++;
+        out << "$" << reg << ": reference " << expected.regs_arr[reg] << ", candidate " << actual.regs_arr[reg];
+    }
+    else if (addr < M::mem_words)
+        out << "memory[" << addr << "]: reference " << M::load(expected_memory, addr) << ", candidate " << M::load(actual_memory, addr);
+    return out.str();
+}
+
+/*
+    Writes memory in the machine code file format that load_machine_code
+    reads.
+
+    @param words How many words, from address 0, to write
+*/
+inline void write_machine_code(std::ostream& out, const uint16_t mem[], size_t words)
+{
+    for (size_t addr = 0; addr < words; addr++)
+    {
+        out << "ram[" << addr << "] = 16'b";
+        for (int bit = 15; bit >= 0; bit--)
+            out << ((mem[addr] >> bit) & 1);
+        out << ";" << std::endl;
+    }
+}
+
+/*
+    64-bit FNV-1a hash, used to key the on-disk result cache.
+*/
+inline uint64_t fnv1a(const void* data, size_t len, uint64_t hash = 14695981039346656037ULL)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+    A result-cache key: the file name an entry is stored under, and the
+    material it hashes. The hash alone only picks the file; the material
+    is stored in the entry and compared on lookup, so two runs whose keys
+    collide never replay each other's output.
+*/
+struct ResultCacheKey
+{
+    std::string name;     // 16 hex digits; empty when no cache is in use
+    std::string material; // the version, flags and trimmed image, as bytes
+
+    bool empty() const { return name.empty(); }
+};
+
+/*
+    Builds the result-cache key for a loaded image. Trailing zero words are
+    left out, so images that differ only in explicit trailing zeros share
+    an entry, just as they share a result.
+
+    @param version The tool's engine version; bumped whenever a change can
+        alter what a run prints, so stale entries are never hit
+    @param mem Memory holding the loaded program
+    @param flags Every run option that can change the output
+    @param size Words in mem
+    @return The key
+*/
+inline ResultCacheKey result_cache_key(const char* version, const uint16_t mem[], const std::string& flags, size_t size = MEM_SIZE)
+{
+    size_t words = size;
+    while (words > 0 && mem[words - 1] == 0)
+        words--;
+    ResultCacheKey key;
+    key.material = std::string(version) + "\n" + flags + "\n" + std::to_string(words) + "\n";
+    key.material.append((const char*)mem, words * sizeof(uint16_t));
+    std::ostringstream name;
+    name << std::hex << std::setfill('0') << std::setw(16) << fnv1a(key.material.data(), key.material.size());
+    key.name = name.str();
+    return key;
+}
+
+/*
+    Looks up a cached result. An entry is a header line
+    "e20-result NAME STEPS LENGTH", the LENGTH bytes of the key material,
+    and then the exact output of the run.
+
+    @param dir The result-cache directory
+    @param output Filled with the cached output on a hit
+    @param steps Filled with the cached instruction count on a hit
+    @return true on a hit; an entry whose material differs from key's, a
+        hash collision, is a miss
+*/
+inline bool result_cache_lookup(const std::string& dir, const ResultCacheKey& key, std::string& output, size_t& steps)
+{
+    std::ifstream entry(dir + "/" + key.name, std::ios::binary);
+    if (!entry.is_open())
+        return false;
+    std::string magic, stored_name;
+    size_t length = 0;
+    entry >> magic >> stored_name >> steps >> length;
+    if (!entry || magic != "e20-result" || stored_name != key.name || length != key.material.size() || entry.get() != '\n')
+        return false;
+    std::string material(length, '\0');
+    if (!entry.read(&material[0], length) || material != key.material)
+        return false;
+    std::ostringstream contents;
+    contents << entry.rdbuf();
+    output = contents.str();
+    return true;
+}
+
+/*
+    Stores a result. The entry is written to a private temporary file and
+    then renamed into place, so concurrent readers see either no entry or a
+    complete one, never a partial write. Temporary names are unique per
+    process and per call, so threads storing the same key do not collide.
+    A colliding key simply replaces the older entry.
+*/
+inline void result_cache_store(const std::string& dir, const ResultCacheKey& key, const std::string& output, size_t steps)
+{
+    static std::atomic<size_t> counter{0};
+    std::string tmp = dir + "/." + key.name + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    {
+        std::ofstream entry(tmp, std::ios::binary);
+        if (!entry.is_open())
+            return; // a read-only or missing cache directory only costs us the cache
+        entry << "e20-result " << key.name << " " << steps << " " << key.material.size() << "\n" << key.material << output;
+        if (!entry)
+        {
+            entry.close();
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp.c_str(), (dir + "/" + key.name).c_str()) != 0)
+        std::remove(tmp.c_str());
+}
+
+/*
+    Sets a flag once a wall-clock delay has passed, for MachineState::timeout.
+    The engines poll the flag at control transfers, so a runaway program
+    stops by itself instead of needing an external kill.
+*/
+class Watchdog
+{
+public:
+    std::atomic<bool> expired{false};
+
+    // Starts the timer; the flag is set after seconds unless this is destroyed first
+    void arm(double seconds)
+    {
+        timer = std::thread([this, seconds]() {
+            std::unique_lock<std::mutex> lock(cancel_mutex);
+            if (!cancel_cv.wait_for(lock, std::chrono::duration<double>(seconds), [this]() { return cancelled; }))
+                expired = true;
+        });
+    }
+
+    ~Watchdog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(cancel_mutex);
+            cancelled = true;
+        }
+        cancel_cv.notify_all();
+        if (timer.joinable())
+            timer.join();
+    }
+
+private:
+    std::thread timer;
+    std::mutex cancel_mutex;
+    std::condition_variable cancel_cv;
+    bool cancelled = false;
+};
+
+/*
+    Host hardware performance counters for profiling the simulator itself.
+    Each counter is opened on its own, so a host that lacks one event (or
+    forbids perf_event_open altogether) still reports whatever it can.
+*/
+struct HostPerf
+{
+    static const size_t NUM_EVENTS = 5;
+    int fds[NUM_EVENTS] = {-1, -1, -1, -1, -1};
+    uint64_t counts[NUM_EVENTS] = {0, 0, 0, 0, 0};
+
+    static const char* event_name(size_t event)
+    {
+        static const char* names[NUM_EVENTS] = {"cycles", "instructions", "branch-misses", "cache-misses", "L1d-read-misses"};
+        return names[event];
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        uint32_t types[NUM_EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+        uint64_t configs[NUM_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+        };
+        for (size_t i = 0; i < NUM_EVENTS; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1; // only the simulator's own user-space work
+            attr.exclude_hv = 1;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        for (size_t i = 0; i < NUM_EVENTS; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        for (size_t i = 0; i < NUM_EVENTS; i++)
+        {
+            if (fds[i] < 0)
+                continue;
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+            {
+                close(fds[i]);
+                fds[i] = -1; // treat a failed read like an unavailable counter
+                continue;
+            }
+            close(fds[i]);
+        }
+#endif
+    }
+
+    /*
+        Prints the counters to std::cerr so the simulator's own output is unchanged.
+
+        @param steps The number of simulated instructions the counters cover
+    */
+    void report(size_t steps) const
+    {
+        std::cerr << "host-perf: " << steps << " simulated instructions" << std::endl;
+        bool any = false;
+        for (size_t i = 0; i < NUM_EVENTS; i++)
+        {
+            std::cerr << "host-perf: " << std::left << std::setw(16) << event_name(i) << std::right;
+            if (fds[i] < 0)
+            {
+                std::cerr << "unavailable" << std::endl;
+                continue;
+            }
+            any = true;
+            std::cerr << std::setw(14) << counts[i];
+            if (steps > 0)
+                std::cerr << "  (" << std::fixed << std::setprecision(3) << (double)counts[i] / steps << " per instruction)";
+            std::cerr << std::endl;
+        }
+        if (fds[0] >= 0 && fds[1] >= 0 && counts[0] > 0)
+            std::cerr << "host-perf: IPC " << std::fixed << std::setprecision(3) << (double)counts[1] / counts[0] << std::endl;
+        if (!any)
+            std::cerr << "host-perf: no hardware counters available (check perf_event_paranoid)" << std::endl;
+    }
+};
+
+#endif // E20_MACHINE_H
@@ -6,87 +6,612 @@
 #include <iomanip>
 #include <regex>
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "e20_machine.h"
 
 using namespace std;
 
-// Some helpful constant values to use
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1<<13;
-size_t const static REG_SIZE = 1<<16;
+// Part of every result-cache key; bump it whenever a change can alter what a run prints
+char const static * const ENGINE_VERSION = "e20_sim-1";
+
+/*
+    Runs the program in the machine's memory to the halt (or until it stops
+    early, see Machine::status) on the chosen engine.
+
+    @return The number of instructions executed
+*/
+template <class M>
+size_t run_engine(Engine engine, M& machine)
+{
+    if (engine == ENGINE_REFERENCE)
+        return run_e20_simulator(machine);
+
+    vector<BasicEngineRun<M>> run(1);
+    run[0].engine = engine;
+    run[0].machine = machine;
+    run[0].prepare();
+    size_t steps = run[0].run();
+    machine = run[0].machine;
+    return steps;
+}
 
+/*
+    Whether a cached result, which is always a clean halt after
+    cached_steps instructions, is also what a run on machine would give.
+    A step limit only ever stops a program at a control transfer after it
+    has run step_limit instructions, so it cannot stop one that halts by then.
+*/
+template <class M>
+bool cached_result_applies(const M& machine, size_t cached_steps)
+{
+    return cached_steps <= machine.step_limit;
+}
 
 /*
-    Loads an E20 machine code file into the list
-    provided by mem. We assume that mem is
-    large enough to hold the values in the machine
-    code file.
+    The part of a result-cache key that describes how a program was run,
+    on which memory layout.
+*/
+template <class M>
+string run_flags(size_t memquantity, const M& machine)
+{
+    return "mem=" + to_string(memquantity) + " illegal=" + to_string(machine.illegal_policy) + " trap=" + to_string(machine.trap_vector) +
+        " words=" + to_string(M::mem_words) + " banks=" + to_string(M::num_banks);
+}
+
+/*
+    One job for --serve: a program image plus its run options.
+*/
+struct ServeJob
+{
+    string id; // echoed back so the client can match replies, which may arrive out of order
+    string image; // machine code, in the same format as a .bin file
+    size_t memquantity = 128; // how many words of memory print_state dumps
+    IllegalPolicy illegal_policy = ILLEGAL_STOP;
+    uint16_t trap_vector = 0;
+    size_t max_steps = SIZE_MAX;
+    double timeout = 0; // seconds; 0 for none
+};
+
+/*
+    Options shared by every --serve worker.
+*/
+struct ServeConfig
+{
+    string result_cache_dir; // empty when --result-cache is not given
+    Engine engine = ENGINE_REFERENCE;
+    ServeJob defaults; // from the command line; the options a request leaves out keep these
+};
+
+/*
+    Runs one job on a worker's machine and frames the reply:
+    "result ID STATUS NBYTES\n" followed by NBYTES of print_state output
+    (or of the load error message). STATUS is ok, error, or the status_name
+    of a run that stopped early, whose reason is printed ahead of its
+    partial state.
+*/
+string run_serve_job(Machine& machine, const ServeJob& job, const ServeConfig& config)
+{
+    machine.reset();
+    machine.illegal_policy = job.illegal_policy;
+    machine.trap_vector = job.trap_vector;
+    machine.step_limit = job.max_steps;
+    Watchdog watchdog;
+    machine.timeout = nullptr;
+    if (job.timeout > 0)
+    {
+        machine.timeout = &watchdog.expired;
+        watchdog.arm(job.timeout);
+    }
+    istringstream image(job.image);
+    ostringstream body;
+    string status = "ok";
+    string payload;
+    if (!load_machine_code(image, machine.memory_arr, body))
+    {
+        status = "error";
+        payload = body.str();
+    }
+    else
+    {
+        ResultCacheKey key;
+        size_t steps = 0;
+        if (!config.result_cache_dir.empty())
+            key = result_cache_key(ENGINE_VERSION, machine.memory_arr, run_flags(job.memquantity, machine));
+        if (key.empty() || !result_cache_lookup(config.result_cache_dir, key, payload, steps) || !cached_result_applies(machine, steps))
+        {
+            steps = run_engine(config.engine, machine);
+            if (machine.status != STATUS_HALTED)
+            {
+                status = status_name(machine.status);
+                report_stop(machine, body);
+            }
+            print_state(machine.pc, machine.regs_arr, machine.memory_arr, job.memquantity, body);
+            payload = body.str();
+            if (!key.empty() && machine.status == STATUS_HALTED) // only clean halts are cached
+                result_cache_store(config.result_cache_dir, key, payload, steps);
+        }
+    }
+    return "result " + job.id + " " + status + " " + to_string(payload.size()) + "\n" + payload;
+}
+
+/*
+    Parses the options that follow "run ID NLINES" on a request line, with
+    the same checks as the command-line options they override.
+
+    @param mem_words Memory size of the machines the job runs on, which
+        bounds mem= and trap=
+    @return false if an option is not recognized or its value is malformed
+        or out of range
+*/
+bool parse_serve_options(istringstream& header, ServeJob& job, size_t mem_words)
+{
+    string option;
+    while (header >> option)
+    {
+        size_t equals = option.find('=');
+        string name = option.substr(0, equals);
+        string value = equals == string::npos ? string() : option.substr(equals + 1);
+        bool ok = false;
+        if (name == "mem")
+            ok = parse_number(value, job.memquantity, 0, mem_words);
+        else if (name == "illegal")
+            ok = parse_illegal_policy(value, job.illegal_policy);
+        else if (name == "trap") // the handler must be one of the machine's addresses
+            ok = parse_number(value, job.trap_vector, 0, mem_words - 1);
+        else if (name == "max-steps")
+            ok = parse_number(value, job.max_steps);
+        else if (name == "timeout")
+            ok = parse_positive(value, job.timeout);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/*
+    Persistent server mode. Reads requests of the form
+
+        run ID NLINES [mem=N] [illegal=stop|nop|trap] [trap=ADDR]
+                      [max-steps=N] [timeout=SEC]
+        <NLINES lines of machine code>
+
+    from in, runs them on a pool of worker threads that each reuse one
+    Machine, and writes each framed reply to out as soon as it finishes.
+    Returns once in is exhausted and every queued job has been answered.
+
+    @param num_threads Number of workers, and so of machines kept alive
+*/
+int serve(istream& in, ostream& out, size_t num_threads, const ServeConfig& config)
+{
+    deque<ServeJob> queue;
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    bool input_done = false;
+    mutex out_mutex;
+
+    auto reply = [&](const string& framed) {
+        lock_guard<mutex> lock(out_mutex);
+        out << framed;
+        out.flush();
+    };
+
+    vector<thread> workers;
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        workers.push_back(thread([&]() {
+            vector<Machine> machine(1);
+            while (true)
+            {
+                ServeJob job;
+                {
+                    unique_lock<mutex> lock(queue_mutex);
+                    queue_cv.wait(lock, [&]() { return input_done || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    job = move(queue.front());
+                    queue.pop_front();
+                }
+                reply(run_serve_job(machine[0], job, config));
+            }
+        }));
+    }
+
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        istringstream header(line);
+        string command;
+        ServeJob job = config.defaults;
+        size_t num_lines = 0;
+        header >> command >> job.id >> num_lines;
+        if (command != "run" || !header)
+        {
+            string message = "Can't parse request: " + line + "\n";
+            reply("result - error " + to_string(message.size()) + "\n" + message);
+            continue;
+        }
+        string request = line;
+        for (size_t i = 0; i < num_lines && getline(in, line); i++)
+        {
+            job.image += line;
+            job.image += '\n';
+        }
+        if (!parse_serve_options(header, job, MEM_SIZE)) // the framing was sound, so answer for this job and keep in step
+        {
+            string message = "Bad option in request: " + request + "\n";
+            reply("result " + job.id + " error " + to_string(message.size()) + "\n" + message);
+            continue;
+        }
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            queue.push_back(move(job));
+        }
+        queue_cv.notify_one();
+    }
+
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        input_done = true;
+    }
+    queue_cv.notify_all();
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    return 0;
+}
 
-    @param f Open file to read from
-    @param mem Array represetnting memory into which to read program
+/*
+    AFL-style fork server. Loads and predecodes the image once, runs it up
+    to the entry pc, and announces "ready PC STEPS". If the program stops
+    before reaching the entry pc (halts, meets an illegal instruction or
+    runs out of steps or time), it prints "stopped STATUS PC STEPS" instead,
+    with the reason on stderr, and exits. Each request
+
+        run ID NPATCH [OPTION=VALUE...]
+        <NPATCH lines of "ADDR VALUE">
+
+    then forks a copy-on-write child that patches those memory words, runs
+    to the halt on the predecoded engine, and sends its print_state output
+    back over a pipe. The options are those of --serve: mem=, and illegal=,
+    trap=, max-steps= and timeout=, which override the server's own for
+    that child (max-steps counts from load, so it includes the warm-up).
+    The reply is framed as in --serve, with crash as one more STATUS:
+    "result ID STATUS NBYTES" followed by NBYTES of output.
+
+    @param machine The loaded machine, not yet run; its illegal policy,
+        trap vector and step limit are the defaults for every child
+    @param entry_pc Where to stop before forking; -1 forks from pc 0
+    @param timeout Seconds the warm-up and each child may run; 0 for no
+        limit
 */
-void load_machine_code(ifstream &f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
+template <class M>
+int fork_server(M& machine, int entry_pc, double timeout, istream& in, ostream& out)
+{
+    const int CHILD_EXIT_STATUS = 10; // a child that stops early exits with this plus its Status
+    vector<Decoded> decoded(M::mem_words);
+    predecode(machine.memory_arr, decoded.data(), M::mem_words);
+    size_t warmup_steps = 0;
+    if (entry_pc >= 0)
+    {
+        Watchdog watchdog; // disarmed before any fork, when it goes out of scope
+        if (timeout > 0)
+        {
+            machine.timeout = &watchdog.expired;
+            watchdog.arm(timeout);
+        }
+        warmup_steps = run_predecoded(machine, decoded.data(), entry_pc);
+        machine.timeout = nullptr;
+    }
+    if (machine.status != STATUS_RUNNING) // children forked from here could only repeat the stop
+    {
+        report_stop(machine, cerr);
+        out << "stopped " << status_name(machine.status) << " " << machine.pc << " " << warmup_steps << endl;
+        return 1;
+    }
+    out << "ready " << machine.pc << " " << warmup_steps << endl;
+
     string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
+    while (getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        istringstream header(line);
+        string command;
+        ServeJob job; // options a request leaves out keep the server's
+        job.illegal_policy = machine.illegal_policy;
+        job.trap_vector = machine.trap_vector;
+        job.max_steps = machine.step_limit;
+        job.timeout = timeout;
+        size_t num_patches = 0;
+        header >> command >> job.id >> num_patches;
+        bool ok = command == "run" && header && parse_serve_options(header, job, M::mem_words);
+        string request = line;
+        vector<pair<size_t, uint16_t>> patches;
+        for (size_t i = 0; i < num_patches && getline(in, line); i++)
+        {
+            istringstream patch(line);
+            size_t addr;
+            unsigned value;
+            if (!(patch >> addr >> value) || addr >= M::mem_words || value >= REG_SIZE)
+                ok = false;
+            else
+                patches.push_back(make_pair(addr, (uint16_t)value));
         }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
+        if (!ok)
+        {
+            string message = "Can't parse request: " + request + "\n";
+            out << "result " << (job.id.empty() ? "-" : job.id) << " error " << message.size() << "\n" << message;
+            out.flush();
+            continue;
         }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
+
+        int result_pipe[2];
+        if (pipe(result_pipe) != 0)
+        {
+            cerr << "Can't create pipe" << endl;
+            return 1;
         }
-        expectedaddr ++;
-        mem[addr] = instr;
+        out.flush(); // the child must not inherit unwritten output
+        pid_t child = fork();
+        if (child < 0)
+        {
+            cerr << "Can't fork" << endl;
+            return 1;
+        }
+        if (child == 0)
+        {
+            close(result_pipe[0]);
+            machine.illegal_policy = job.illegal_policy;
+            machine.trap_vector = job.trap_vector;
+            machine.step_limit = job.max_steps;
+            Watchdog watchdog; // threads do not survive fork, so each child starts its own
+            if (job.timeout > 0)
+            {
+                machine.timeout = &watchdog.expired;
+                watchdog.arm(job.timeout);
+            }
+            // patches go through store(), as the program's own sw would, so
+            // they are dirty-marked and a bank select switches banks
+            for (size_t i = 0; i < patches.size(); i++)
+            {
+                if (machine.store(patches[i].first, patches[i].second))
+                    predecode(machine.memory_arr, decoded.data(), M::mem_words);
+                else
+                    decoded[patches[i].first] = decode(patches[i].second);
+            }
+            run_predecoded(machine, decoded.data());
+            ostringstream body;
+            report_stop(machine, body);
+            print_state(machine.pc, machine.regs_arr, machine.memory_arr, job.memquantity, body);
+            string payload = body.str();
+            size_t written = 0;
+            while (written < payload.size())
+            {
+                ssize_t n = write(result_pipe[1], payload.data() + written, payload.size() - written);
+                if (n <= 0)
+                    _exit(1);
+                written += n;
+            }
+            _exit(machine.status == STATUS_HALTED ? 0 : CHILD_EXIT_STATUS + machine.status);
+        }
+
+        close(result_pipe[1]);
+        string payload;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(result_pipe[0], buffer, sizeof(buffer))) > 0)
+            payload.append(buffer, n);
+        close(result_pipe[0]);
+        int status = 0;
+        waitpid(child, &status, 0);
+        string verdict = "ok";
+        if (WIFEXITED(status) && WEXITSTATUS(status) > CHILD_EXIT_STATUS && WEXITSTATUS(status) <= CHILD_EXIT_STATUS + STATUS_TIMEOUT)
+            verdict = status_name((Status)(WEXITSTATUS(status) - CHILD_EXIT_STATUS));
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            verdict = "crash";
+        out << "result " << job.id << " " << verdict << " " << payload.size() << "\n" << payload;
+        out.flush();
     }
+    return 0;
 }
 
 /*
-    Prints the current state of the simulator, including
-    the current program counter, the current register values,
-    and the first memquantity elements of memory.
-
-    @param pc The final value of the program counter
-    @param regs Final value of all registers
-    @param memory Final value of memory
-    @param memquantity How many words of memory to dump
+    Prints the runs of words in [0, words) where now differs from loaded,
+    eight words to a line as in print_state. Pages that dirty never saw
+    written are skipped, so the cost follows what the program wrote, not
+    the memory size.
+
+    @param label Put before the first address of every line
+    @param base Added to every address printed
+    @return The number of words that differ
 */
-void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity) {
-    cout << setfill(' ');
-    cout << "Final state:" << endl;
-    cout << "\tpc=" <<setw(5)<< pc << endl;
-
-    for (size_t reg=0; reg<NUM_REGS; reg++)
-        cout << "\t$" << reg << "="<<setw(5)<<regs[reg]<<endl;
-
-    cout << setfill('0');
-    bool cr = false;
-    for (size_t count=0; count<memquantity; count++) {
-        cout << hex << setw(4) << memory[count] << " ";
-        cr = true;
-        if (count % 8 == 7) {
-            cout << endl;
-            cr = false;
+template <class Dirty>
+size_t print_changed_words(const uint16_t now[], const uint16_t loaded[], size_t words, const Dirty& dirty, const string& label, size_t base, ostream& out)
+{
+    size_t changed = 0;
+    size_t addr = 0;
+    while (addr < words)
+    {
+        if (!dirty.test(addr / PAGE_WORDS))
+        {
+            addr = (addr / PAGE_WORDS + 1) * PAGE_WORDS;
+            continue;
+        }
+        if (now[addr] == loaded[addr])
+        {
+            addr++;
+            continue;
+        }
+        size_t end = addr + 1;
+        while (end < words && now[end] != loaded[end])
+            end++;
+        changed += end - addr;
+        for (; addr < end; addr += 8)
+        {
+            size_t line_end = min(end, addr + 8);
+            out << "\t" << label << base + addr;
+            if (line_end - addr > 1)
+                out << "-" << base + line_end - 1;
+            out << ":" << hex;
+            for (size_t a = addr; a < line_end; a++)
+                out << " " << setw(4) << now[a];
+            out << dec << endl;
         }
+        addr = end;
+    }
+    return changed;
+}
+
+/*
+    Prints the words of memory that differ from the image as loaded, as
+    ranges of consecutive addresses.
+
+    @param loaded The machine's memory just after loading
+*/
+template <class M>
+void print_memory_diff(const M& machine, const uint16_t loaded[], ostream& out)
+{
+    out << dec << setfill('0') << "Changed memory:" << endl;
+    size_t changed = print_changed_words(machine.memory_arr, loaded, M::mem_words, machine.dirty, "", 0, out);
+    out << "\t" << changed << " words changed" << endl;
+}
+
+/*
+    The banked version: the lower half as usual, then every bank, each
+    against what it held at load (the image's upper half for bank 0,
+    zeros for the rest), its lines labelled "bank B" with window
+    addresses.
+*/
+template <size_t Banks>
+void print_memory_diff(const BankedMachine<Banks>& machine, const uint16_t loaded[], ostream& out)
+{
+    typedef BankedMachine<Banks> M;
+    out << dec << setfill('0') << "Changed memory:" << endl;
+    size_t changed = print_changed_words(machine.memory_arr, loaded, M::BANK_WORDS, machine.dirty, "", 0, out);
+    vector<uint16_t> zeros(M::BANK_WORDS, 0);
+    for (size_t b = 0; b < Banks; b++)
+    {
+        changed += print_changed_words(machine.bank_words(b), b == 0 ? loaded + M::BANK_WORDS : zeros.data(), M::BANK_WORDS,
+            machine.bank_dirty[b], "bank " + to_string(b) + " ", M::BANK_WORDS, out);
     }
-    if (cr)
-        cout << endl;
+    out << "\t" << changed << " words changed" << endl;
 }
 
-void sign_extend7_func(uint16_t& imm7)
+/*
+    How to run one program file; everything but the memory layout, which
+    picks the machine type.
+*/
+struct RunOptions
+{
+    Engine engine = ENGINE_REFERENCE;
+    IllegalPolicy illegal_policy = ILLEGAL_STOP;
+    uint16_t trap_vector = 0;
+    size_t max_steps = SIZE_MAX;
+    double timeout = 0; // seconds; 0 for none
+    bool host_perf = false;
+    bool fork_server = false;
+    int entry_pc = -1; // see fork_server()
+    string result_cache_dir; // empty when --result-cache is not given
+    bool diff_mem = false; // also print the memory the run changed
+};
+
+/*
+    Loads the program in f onto a machine of type M, runs it and prints its
+    final state (or serves forks of it, with --fork-server).
+
+    @return The process exit code
+*/
+template <class M>
+int simulate(istream& f, const RunOptions& options)
 {
-    if ((imm7 >> 6) == 1) //msb of the imm7 is set, aka is 1, so imm7 < 0; Sign extend
+    // Load f and parse using load_machine_code
+    vector<M> machines(1); // pc, registers and memory
+    M& machine = machines[0];
+    machine.reset(); // initializes pc, all registers and all memory to 0
+    machine.illegal_policy = options.illegal_policy;
+    machine.trap_vector = options.trap_vector;
+    machine.step_limit = options.max_steps;
+
+    if (!load_machine_code(f, machine.memory_arr, cerr, M::mem_words))
+    {
+        return 1;
+    }
+    vector<uint16_t> loaded; // for --diff-mem
+    if (options.diff_mem)
+        loaded.assign(machine.memory_arr, machine.memory_arr + M::mem_words);
+
+    if (options.fork_server)
     {
-        imm7 = imm7 | 65408;
+        return fork_server(machine, options.entry_pc, options.timeout, cin, cout);
     }
+
+    Watchdog watchdog;
+    if (options.timeout > 0)
+    {
+        machine.timeout = &watchdog.expired;
+        watchdog.arm(options.timeout);
+    }
+
+    // Do simulation.
+    const string& result_cache_dir = options.result_cache_dir;
+    ResultCacheKey cache_key;
+    if (!result_cache_dir.empty() && !options.host_perf)
+    {
+        cache_key = result_cache_key(ENGINE_VERSION, machine.memory_arr, run_flags(128, machine) + (options.diff_mem ? " diff-mem" : ""), M::mem_words);
+        string cached_output;
+        size_t cached_steps;
+        if (result_cache_lookup(result_cache_dir, cache_key, cached_output, cached_steps) && cached_result_applies(machine, cached_steps))
+        {
+            cout << cached_output;
+            return 0;
+        }
+    }
+
+    size_t steps;
+    if (options.host_perf)
+    {
+        HostPerf perf; // counts the host's own cycles, instructions and misses while the simulation runs
+        perf.start();
+        steps = run_engine(options.engine, machine);
+        perf.stop();
+        perf.report(steps);
+    }
+    else
+    {
+        steps = run_engine(options.engine, machine);
+    }
+
+    if (machine.status != STATUS_HALTED)
+    {
+        report_stop(machine, cerr);
+        cache_key = ResultCacheKey(); // only clean halts are cached
+    }
+
+    // print the final state of the simulator before ending, using print_state
+    ostringstream output;
+    print_state(machine.pc, machine.regs_arr, machine.memory_arr, 128, output);
+    if (options.diff_mem)
+        print_memory_diff(machine, loaded.data(), output);
+    cout << output.str();
+    if (!cache_key.empty())
+        result_cache_store(result_cache_dir, cache_key, output.str(), steps);
+
+    if (machine.status == STATUS_ILLEGAL)
+        return 1;
+    return machine.status == STATUS_HALTED ? 0 : 2;
 }
 
 /**
@@ -100,11 +625,81 @@ int main(int argc, char *argv[]) {
     char* filename = nullptr;
     bool do_help = false;
     bool arg_error = false;
+    RunOptions options;
+    size_t mem_words = MEM_SIZE;
+    size_t banks = 0;
+    bool do_serve = false;
+    ServeConfig serve_config;
+    size_t num_threads = thread::hardware_concurrency();
+    bool engine_given = false;
+    bool threads_given = false;
     for (int i=1; i<argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-",0)==0) {
             if (arg== "-h" || arg == "--help")
                 do_help = true;
+            else if (arg == "--host-perf")
+                options.host_perf = true;
+            else if (arg == "--diff-mem")
+                options.diff_mem = true;
+            else if (arg == "--illegal") {
+                i++;
+                if (i>=argc || !parse_illegal_policy(argv[i], options.illegal_policy))
+                    arg_error = true;
+            }
+            else if (arg == "--trap-vector") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], options.trap_vector, 0, REG_SIZE - 1))
+                    arg_error = true;
+            }
+            else if (arg == "--max-steps") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], options.max_steps))
+                    arg_error = true;
+            }
+            else if (arg == "--timeout") {
+                i++;
+                if (i>=argc || !parse_positive(argv[i], options.timeout))
+                    arg_error = true;
+            }
+            else if (arg == "--engine") {
+                i++;
+                if (i>=argc || !parse_engine(argv[i], options.engine))
+                    arg_error = true;
+                engine_given = true;
+            }
+            else if (arg == "--serve")
+                do_serve = true;
+            else if (arg == "--fork-server")
+                options.fork_server = true;
+            else if (arg == "--entry") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], options.entry_pc, 0, REG_SIZE - 1))
+                    arg_error = true;
+            }
+            else if (arg == "--result-cache") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    options.result_cache_dir = argv[i];
+            }
+            else if (arg == "--mem-words") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], mem_words))
+                    arg_error = true;
+            }
+            else if (arg == "--banks") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], banks))
+                    arg_error = true;
+            }
+            else if (arg == "--threads") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], num_threads, 1))
+                    arg_error = true;
+                threads_given = true;
+            }
             else
                 arg_error = true;
         } else {
@@ -115,171 +710,103 @@ int main(int argc, char *argv[]) {
         }
     }
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] filename" << endl << endl;
+    bool supported_layout = banks == 0 ? mem_words == 8192 || mem_words == 12288 || mem_words == 16384 || mem_words == 32768 || mem_words == 65536 :
+        mem_words == MEM_SIZE && (banks == 2 || banks == 4 || banks == 8 || banks == 16);
+    // each mode takes only the options it honours: --serve runs every job on
+    // an 8K-word Machine and prints just the final state, and --fork-server
+    // children run on the predecoded engine with no cache or measurement
+    bool serve_error = do_serve && (options.fork_server || mem_words != MEM_SIZE || banks != 0 || options.trap_vector >= MEM_SIZE ||
+        options.diff_mem || options.host_perf || options.entry_pc >= 0);
+    bool fork_server_error = options.fork_server && ((engine_given && options.engine != ENGINE_PREDECODED) || options.diff_mem ||
+        options.host_perf || !options.result_cache_dir.empty());
+    bool mode_error = serve_error || fork_server_error || (threads_given && !do_serve) || (options.entry_pc >= 0 && !options.fork_server);
+    if (arg_error || do_help || (filename == nullptr) == !do_serve || !supported_layout || mode_error) {
+        cerr << "usage " << argv[0] << " [-h] [--engine ENGINE] [--illegal POLICY] [--trap-vector ADDR]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--max-steps N] [--timeout SEC] [--host-perf] [--result-cache DIR]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--diff-mem] [--mem-words N | --banks B] filename" << endl;
+        cerr << "      " << argv[0] << " --serve [--threads N] [--result-cache DIR] [--engine ENGINE]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--illegal POLICY] [--trap-vector ADDR] [--max-steps N] [--timeout SEC]" << endl;
+        cerr << "      " << argv[0] << " --fork-server [--entry PC] [--engine predecoded] [--illegal POLICY]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--trap-vector ADDR] [--max-steps N] [--timeout SEC]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--mem-words N | --banks B] filename" << endl << endl;
         cerr << "Simulate E20 machine" << endl << endl;
         cerr << "positional arguments:" << endl;
         cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
         cerr << "optional arguments:"<<endl;
         cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  --engine ENGINE  reference (default), predecoded, trace (predecoded"<<endl;
+        cerr << "              plus compiled traces of hot loops), or threaded (predecoded"<<endl;
+        cerr << "              handlers chained by tail calls)"<<endl;
+        cerr << "  --illegal POLICY  what an undefined opcode 0 function code does: stop"<<endl;
+        cerr << "              (default; print a diagnostic and the state, exit 1), nop,"<<endl;
+        cerr << "              or trap (jump to --trap-vector with $7 = pc + 1)"<<endl;
+        cerr << "  --trap-vector ADDR  handler address for --illegal trap (default 0)"<<endl;
+        cerr << "  --max-steps N  stop after about N instructions, at the end of the basic"<<endl;
+        cerr << "              block that reaches N, printing the partial state (exit 2)"<<endl;
+        cerr << "  --timeout SEC  likewise stop once SEC seconds of wall-clock time pass"<<endl;
+        cerr << "  --mem-words N  words of memory: 8192 (default), 12288, 16384, 32768 or"<<endl;
+        cerr << "              65536; addresses and pc wrap at N"<<endl;
+        cerr << "  --banks B   64K-word address space whose upper half is a window onto"<<endl;
+        cerr << "              one of B (2, 4, 8 or 16) banks of 32K words; sw the bank"<<endl;
+        cerr << "              number to address 32767 to switch"<<endl;
+        cerr << "  --diff-mem  after the final state, list the ranges of memory that the"<<endl;
+        cerr << "              run changed, with their new contents"<<endl;
+        cerr << "  --host-perf  report host cycles, instructions, branch-misses and"<<endl;
+        cerr << "               cache-misses per simulated instruction (Linux only)"<<endl;
+        cerr << "  --serve     read jobs (\"run ID NLINES [OPTION=VALUE...]\" followed by NLINES lines"<<endl;
+        cerr << "              of machine code) from stdin and write framed results"<<endl;
+        cerr << "              (\"result ID STATUS NBYTES\" followed by NBYTES of output)"<<endl;
+        cerr << "              to stdout, running them on a pool of reusable machines;"<<endl;
+        cerr << "              --engine applies to every job, and --illegal, --trap-vector,"<<endl;
+        cerr << "              --max-steps and --timeout are the defaults a request's"<<endl;
+        cerr << "              options override"<<endl;
+        cerr << "  --threads N  number of --serve workers (default: one per core)"<<endl;
+        cerr << "  --fork-server  load and predecode filename once, run it to --entry, then"<<endl;
+        cerr << "              fork a child per \"run ID NPATCH [OPTION=VALUE...]\" request on"<<endl;
+        cerr << "              stdin (options as for --serve), each followed by NPATCH"<<endl;
+        cerr << "              \"ADDR VALUE\" memory patches; children always run on the"<<endl;
+        cerr << "              predecoded engine"<<endl;
+        cerr << "  --entry PC  pc at which --fork-server stops and starts forking"<<endl;
+        cerr << "  --result-cache DIR  reuse the output of earlier runs of the same image"<<endl;
+        cerr << "              and options, stored in DIR (ignored with --host-perf)"<<endl;
         return 1;
     }
 
+    if (do_serve)
+    {
+        serve_config.result_cache_dir = options.result_cache_dir;
+        serve_config.engine = options.engine;
+        serve_config.defaults.illegal_policy = options.illegal_policy;
+        serve_config.defaults.trap_vector = options.trap_vector;
+        serve_config.defaults.max_steps = options.max_steps;
+        serve_config.defaults.timeout = options.timeout;
+        return serve(cin, cout, num_threads == 0 ? 1 : num_threads, serve_config);
+    }
+
     ifstream f(filename);
     if (!f.is_open()) {
         cerr << "Can't open file "<<filename<<endl;
         return 1;
     }
 
-
-    // Load f and parse using load_machine_code
-    uint16_t pc = 0; //initializes pc to 0
-    uint16_t regs_arr[NUM_REGS]; //create an array called regs_arr of size 8 (index 0 to index 7), each index can hold a unsigned 16-bit integer
-    for (size_t i = 0; i < NUM_REGS; i++) //loop over each element in the array
-    {
-        regs_arr[i] = 0; //initializes all registers to 0
-    }
-    uint16_t memory_arr[MEM_SIZE]; //create an array called memory_arr of size 8192 (index 0 to index 8191), each index can hold a unsigned 16-bit integer
-    for (size_t i = 0; i < MEM_SIZE; i++) //loop over each element in the array
+    // one instantiation of the engines per supported memory layout
+    if (banks != 0)
     {
-        memory_arr[i] = 0; //initializes all memory to 0
-    }
-
-
-    // Do simulation.
-    load_machine_code(f, memory_arr);
-    bool halt = false;
-
-    while (!halt)
-    {
-        uint16_t index = pc % MEM_SIZE; // pc is 16-bit unsigned integer, MEM_SIZE is 13-bit; this always makes sure pc < MEM_SIZE. If PC > MEM_SIZE, modulus forces pc to wrap around to 0
-        uint16_t instruction = memory_arr[index]; //indexes memory_arr at index; will never be out of range due to line above, and will always loop over and over without a problem
-
-
-        //Extract all possible combinations
-        uint16_t opcode = instruction >> 13;
-        uint16_t bits10_12 = (instruction >> 10) & 7;
-        uint16_t bits7_9 = (instruction >> 7) & 7;
-        uint16_t bits4_6 = (instruction >> 4) & 7;
-        uint16_t bits0_3 = instruction & 15;
-        uint16_t bits0_6 = instruction & 127;
-        uint16_t bits0_12 = instruction & 8191;
-        sign_extend7_func(bits0_6);
-
-        if (opcode == 0) //add, sub, or, and, slt, jr, 
+        switch (banks)
         {
-            if (bits0_3 == 0) //add
-            {
-                regs_arr[bits4_6] = regs_arr[bits10_12] + regs_arr[bits7_9];
-                pc+=1;
-            }
-
-            else if (bits0_3 == 1) //sub
-            {
-                regs_arr[bits4_6] = regs_arr[bits10_12] - regs_arr[bits7_9];
-                pc+=1;
-            }
-            
-            else if (bits0_3 == 2) //or
-            {
-                regs_arr[bits4_6] = regs_arr[bits10_12] | regs_arr[bits7_9];
-                pc+=1;
-            }
-
-            else if (bits0_3 == 3) //and
-            {
-                regs_arr[bits4_6] = regs_arr[bits10_12] & regs_arr[bits7_9];
-                pc+=1;
-            }
-
-            else if (bits0_3 == 4) //slt
-            {
-                if (regs_arr[bits10_12] < regs_arr[bits7_9])
-                {
-                    regs_arr[bits4_6] = 1;
-                }
-                else
-                {
-                    regs_arr[bits4_6] = 0;
-                }
-                pc+=1;
-            }
-
-            else if (bits0_3 == 8) //jr
-            {
-                pc = regs_arr[bits10_12];
-            }
-
-            regs_arr[0] = 0; //ensures that the zero register is always 0
-        }
-
-        else if (opcode == 1) //addi
-        {
-            regs_arr[bits7_9] = regs_arr[bits10_12] + bits0_6;
-            regs_arr[0] = 0; //ensures that the zero register is always 0
-            pc+=1;
-        }
-
-        else if (opcode == 2) //j
-        {
-            if (pc == bits0_12) //if pc will jump to itself
-            {
-                halt = true; //set halt to be true to stop loop
-            }
-            pc = bits0_12;
-        }
-
-        else if (opcode == 3) //jal
-        {
-            regs_arr[7] = pc + 1;
-            pc = bits0_12;
-        }
-
-        else if (opcode == 4) //lw
-        {
-            uint16_t address = (regs_arr[bits10_12] + bits0_6) % MEM_SIZE;
-            regs_arr[bits7_9] = memory_arr[address];
-            regs_arr[0] = 0; //ensures that the zero register is always 0
-            pc+=1;
-        }
-
-        else if (opcode == 5) //sw
-        {
-            uint16_t address = (regs_arr[bits10_12] + bits0_6) % MEM_SIZE;
-            memory_arr[address] = regs_arr[bits7_9];
-            pc+=1;
-        }
-
-        else if (opcode == 6) //jeq
-        {
-            if (regs_arr[bits10_12] == regs_arr[bits7_9])
-            {
-                pc = pc + 1 + bits0_6;
-            }
-            else
-            {
-                pc+=1;
-            }
-        }
-
-        else if (opcode == 7) //slti
-        {
-            if (regs_arr[bits10_12] < bits0_6)
-            {
-                regs_arr[bits7_9] = 1;
-            }
-            else
-            {
-                regs_arr[bits7_9] = 0;
-            }
-            regs_arr[0] = 0;
-            pc+=1;
+        case 2: return simulate<BankedMachine<2>>(f, options);
+        case 4: return simulate<BankedMachine<4>>(f, options);
+        case 8: return simulate<BankedMachine<8>>(f, options);
+        default: return simulate<BankedMachine<16>>(f, options);
         }
     }
-    
-    // print the final state of the simulator before ending, using print_state
-    print_state(pc, regs_arr, memory_arr, 128);
-
-    return 0;
+    switch (mem_words)
+    {
+    case 12288: return simulate<BasicMachine<12288>>(f, options);
+    case 16384: return simulate<BasicMachine<16384>>(f, options);
+    case 32768: return simulate<BasicMachine<32768>>(f, options);
+    case 65536: return simulate<BasicMachine<65536>>(f, options);
+    default: return simulate<Machine>(f, options);
+    }
 }
 //ra0Eequ6ucie6Jei0koh6phishohm9
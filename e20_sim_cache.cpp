@@ -7,6 +7,21 @@
 #include <limits>
 #include <iomanip>
 #include <regex>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <random>
+#include <map>
+#include <deque>
+#include <queue>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "e20_machine.h"
 
 using namespace std;
 
@@ -17,41 +32,407 @@ Each level has a certain number of rows
 Each row has a certain amount of blocks
 */
 
-// Some helpful constant values to use
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1<<13;
-size_t const static REG_SIZE = 1<<16;
-
-struct Block
-{
-    uint16_t tag = -1; // initialize tag to -1
-};
+// Part of every result-cache key; bump it whenever a change can alter what a run prints
+char const static * const ENGINE_VERSION = "e20_sim_cache-1";
 
 struct Row
 {
-    vector<Block> blocks_vec; // stores all the blocks of any given row, this .size() also can never be more than 4; .size() will give you the current number of blocks in the row
-    int associativity; // the max size of the blocks vector; aka how many blocks can be stored in one row; you can keep on adding a block into the blocks vector as long as the blocks_vec.size() < associativity
+    int associativity; // how many blocks can be stored in one row; their tags live in the level's tag store
+    uint64_t hits = 0; // accesses (lw or sw) whose tag was already in this row
+    uint64_t misses = 0; // accesses whose tag had to be brought into this row
+    uint64_t evictions = 0; // misses that pushed out a valid block, rather than filling an empty one
 };
 
 struct Level
 {
     Level(int cache_size, int num_of_rows, int associativity, int blocksize) : blocksize(blocksize) //: num_of_rows(num_of_rows)
     {
+        row_stride = (associativity + 15) / 16 * 16; // whole 16-tag vectors, so a compare never reads into the next row
+        tags = vector<uint16_t>(num_of_rows * row_stride, (uint16_t)-1); // every tag starts as -1, an empty block
         for (int i = 0; i < num_of_rows; i++)
         {
             Row new_row; // creates a new row object called new_row and passes in associativity
-            new_row.blocks_vec = vector<Block>(associativity);
             new_row.associativity = associativity;
             rows_vec.push_back(new_row); // finally, push back the newly created row into the rows vector
         }
     }
-    vector<Row> rows_vec; // each level object has a set number of rows, with each row containing a vector of blocks of size associativity
+
+    // @return The tags of one row's blocks, least recently used first
+    uint16_t* row_tags(size_t row) { return tags.data() + row * row_stride; }
+
+    vector<Row> rows_vec; // each level object has a set number of rows, each holding associativity blocks
+    vector<uint16_t> tags; // the flat tag store: row r's tags start at r * row_stride
+    size_t row_stride;
     int blocksize; // blocksize is how many values you can store in one block (all these values will have the same tag)
+    uint64_t latency = 1; // cycles for a hit; only the out-of-order timing model uses it
+};
+
+/*
+    Geometry and timing of the DRAM behind the last cache level, in core
+    cycles. Words are interleaved across banks a row at a time.
+*/
+struct DramConfig
+{
+    int banks = 8;
+    int row_words = 64; // words per row buffer
+    bool open_page = true; // leave the row open after an access (else precharge at once)
+    int tRCD = 14; // activate: row to column delay
+    int tCAS = 14; // column access to data
+    int tRP = 14; // precharge
+    size_t queue_depth = 16; // posted writes the controller holds before it must drain
+};
+
+struct DramBank
+{
+    int open_row = -1; // row in the row buffer, or -1 when precharged
+    uint64_t ready = 0; // cycle at which the bank can take its next access
+};
+
+struct DramRequest
+{
+    uint16_t address;
+    bool is_write;
+    uint64_t arrival; // core cycle at which the request reached the controller
+};
+
+/*
+    DRAM controller and banks. Reads block the core and writes (the cache
+    is write-through) are posted to a queue. The controller works through
+    that queue in the background and, when a read arrives, schedules
+    everything pending FR-FCFS: the oldest request that hits an open row
+    first, else the oldest request. It issues one command per cycle.
+*/
+struct Dram
+{
+    Dram(const DramConfig& config) : config(config), banks(config.banks) {}
+
+    /*
+        @param now Instructions executed so far; read stalls are added to
+            turn this into a core cycle, unless now is already a cycle
+        @return Cycles from the read's arrival until its data returns
+    */
+    uint64_t read(uint16_t address, uint64_t now)
+    {
+        uint64_t arrival = arrive(now);
+        queue.push_back(DramRequest{address, false, arrival});
+        while (true)
+        {
+            size_t next = pick();
+            DramRequest request = queue[next];
+            queue.erase(queue.begin() + next);
+            uint64_t done = serve(request);
+            if (!request.is_write)
+            {
+                uint64_t latency = done - arrival;
+                reads++;
+                read_latency += latency;
+                return latency;
+            }
+        }
+    }
+
+    void write(uint16_t address, uint64_t now)
+    {
+        queue.push_back(DramRequest{address, true, arrive(now)});
+        while (queue.size() > config.queue_depth)
+        {
+            size_t next = pick();
+            DramRequest request = queue[next];
+            queue.erase(queue.begin() + next);
+            serve(request);
+        }
+    }
+
+    DramConfig config;
+    vector<DramBank> banks;
+    vector<DramRequest> queue; // pending requests, oldest first
+    uint64_t command_free = 0; // cycle at which the controller can issue its next command
+    uint64_t last_arrival = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t row_hits = 0; // row already open
+    uint64_t row_empty = 0; // bank precharged: activate, then access
+    uint64_t row_conflicts = 0; // another row open: precharge, activate, then access
+    uint64_t read_latency = 0; // summed over reads; also the core's total stall
+    bool now_is_cycle = false; // set by a timing model that counts cycles itself
+
+private:
+    int bank_of(uint16_t address) const { return (address / config.row_words) % config.banks; }
+    int row_of(uint16_t address) const { return address / (config.row_words * config.banks); }
+
+    // Serves, in the background, whatever the controller had time for before now
+    uint64_t arrive(uint64_t now)
+    {
+        uint64_t arrival = max(now + (now_is_cycle ? 0 : read_latency), last_arrival); // a fast-forward restarts instruction counts
+        last_arrival = arrival;
+        while (!queue.empty() && command_free < arrival)
+        {
+            size_t next = pick();
+            DramRequest request = queue[next];
+            queue.erase(queue.begin() + next);
+            serve(request);
+        }
+        return arrival;
+    }
+
+    // FR-FCFS: the oldest row hit, else the oldest request
+    size_t pick() const
+    {
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            if (banks[bank_of(queue[i].address)].open_row == row_of(queue[i].address))
+                return i;
+        }
+        return 0;
+    }
+
+    // @return The cycle at which the request's data transfer completes
+    uint64_t serve(const DramRequest& request)
+    {
+        DramBank& bank = banks[bank_of(request.address)];
+        int row = row_of(request.address);
+        uint64_t issue = max(command_free, request.arrival);
+        command_free = issue + 1;
+        uint64_t start = max(issue, bank.ready);
+        uint64_t latency = config.tCAS;
+        if (bank.open_row == row)
+            row_hits++;
+        else if (bank.open_row < 0)
+        {
+            row_empty++;
+            latency += config.tRCD;
+        }
+        else
+        {
+            row_conflicts++;
+            latency += config.tRP + config.tRCD;
+        }
+        uint64_t done = start + latency;
+        bank.ready = done;
+        bank.open_row = row;
+        if (!config.open_page)
+        {
+            bank.ready += config.tRP; // precharge right away; the next access finds the bank closed
+            bank.open_row = -1;
+        }
+        if (request.is_write)
+            writes++;
+        return done;
+    }
 };
 
 struct Cache
 {
     vector<Level> levels_vec; // stores l1 and l2
+    bool log_accesses = true; // print a log line per access; off when only the totals are wanted
+    vector<Dram> dram; // the memory behind the last level; empty when no DRAM model is configured
+    uint64_t memory_latency = 100; // cycles for a last-level miss without a DRAM model
+};
+
+/*
+    LRU stack (reuse) distance of every access, measured in distinct blocks
+    of one blocksize. A Fenwick tree over access times marks the most recent
+    access of each block, so the number of distinct blocks touched since a
+    block's previous access is a prefix-sum query: O(log n) per access.
+    When the time axis fills up, the live marks are renumbered in order,
+    which keeps the tree no larger than a small multiple of the block count.
+*/
+struct ReuseDistance
+{
+    ReuseDistance(int blocksize) : blocksize(blocksize), last_time(MEM_SIZE / blocksize, -1), histogram(MEM_SIZE / blocksize, 0)
+    {
+        fenwick.assign(2 * last_time.size() + 1024, 0);
+    }
+
+    void access(uint16_t address)
+    {
+        size_t blockid = address / blocksize;
+        if (time == fenwick.size())
+        {
+            compact();
+        }
+        if (last_time[blockid] < 0)
+        {
+            cold++; // first touch: infinite distance
+        }
+        else
+        {
+            size_t last = last_time[blockid];
+            histogram[prefix_sum(time) - prefix_sum(last + 1)]++; // distinct blocks accessed strictly between the two accesses
+            add(last, -1);
+        }
+        add(time, 1);
+        last_time[blockid] = time;
+        time++;
+        accesses++;
+    }
+
+    int blocksize;
+    vector<int64_t> last_time; // per block, time slot of its latest access, or -1 if never accessed
+    vector<int> fenwick; // 1-based binary indexed tree over time slots
+    size_t time = 0; // next free time slot
+    uint64_t accesses = 0;
+    uint64_t cold = 0;
+    vector<uint64_t> histogram; // histogram[d] is the number of accesses with reuse distance d
+
+private:
+    void add(size_t slot, int delta)
+    {
+        for (size_t i = slot + 1; i <= fenwick.size(); i += i & (0 - i))
+            fenwick[i - 1] += delta;
+    }
+
+    // number of marked slots in [0, slot)
+    int prefix_sum(size_t slot) const
+    {
+        int sum = 0;
+        for (size_t i = slot; i > 0; i -= i & (0 - i))
+            sum += fenwick[i - 1];
+        return sum;
+    }
+
+    void compact()
+    {
+        vector<pair<int64_t, size_t>> live; // (old time, blockid)
+        for (size_t b = 0; b < last_time.size(); b++)
+        {
+            if (last_time[b] >= 0)
+                live.push_back(make_pair(last_time[b], b));
+        }
+        sort(live.begin(), live.end());
+        fill(fenwick.begin(), fenwick.end(), 0);
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            last_time[live[i].second] = i;
+            add(i, 1);
+        }
+        time = live.size();
+    }
+};
+
+/*
+    Number of distinct blocks touched in each window of a fixed number of
+    accesses, for every blocksize tracked by ReuseDistance.
+*/
+struct WorkingSet
+{
+    WorkingSet(int blocksize) : blocksize(blocksize), last_window(MEM_SIZE / blocksize, -1) {}
+
+    void access(uint16_t address, int64_t window)
+    {
+        size_t blockid = address / blocksize;
+        if (window != current_window)
+        {
+            sizes.resize(window + 1, 0);
+            current_window = window;
+        }
+        if (last_window[blockid] != window) // first touch of this block in the window
+        {
+            last_window[blockid] = window;
+            sizes[window]++;
+        }
+    }
+
+    int blocksize;
+    vector<int64_t> last_window; // per block, the last window it was touched in
+    int64_t current_window = -1;
+    vector<uint64_t> sizes; // sizes[w] is the working set of window w, in blocks
+};
+
+/*
+    Optional per-run analyses fed from the lw and sw paths. Each one is
+    disabled while its storage is empty, so a plain run pays only for the
+    emptiness checks.
+*/
+struct Analysis
+{
+    vector<uint64_t> word_reads; // lw count per memory word; MEM_SIZE entries when --heatmap is given
+    vector<uint64_t> word_writes; // sw count per memory word
+    vector<ReuseDistance> reuse; // one per blocksize when --reuse is given
+    vector<WorkingSet> working_sets; // parallel to reuse
+    uint64_t ws_window = 1024; // accesses per working-set window
+    uint64_t accesses = 0; // lw and sw seen so far
+};
+
+/*
+    Feeds one lw or sw address to every enabled analysis.
+*/
+void record_access(Analysis& analysis, uint16_t address, bool is_store_word)
+{
+    if (!analysis.word_reads.empty())
+    {
+        if (is_store_word)
+            analysis.word_writes[address]++;
+        else
+            analysis.word_reads[address]++;
+    }
+    if (!analysis.reuse.empty())
+    {
+        int64_t window = analysis.accesses / analysis.ws_window;
+        for (size_t i = 0; i < analysis.reuse.size(); i++)
+        {
+            analysis.reuse[i].access(address);
+            analysis.working_sets[i].access(address, window);
+        }
+    }
+    analysis.accesses++;
+}
+
+/*
+    Hit, miss and eviction counts summed over the rows of one cache level.
+*/
+struct LevelTotals
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+/*
+    What the cache model saw during one interval simulated in detail.
+*/
+struct IntervalStats
+{
+    uint64_t interval; // index of the interval
+    uint64_t instructions; // its length; the last interval of a run may be short
+    vector<LevelTotals> levels; // per cache level, counts within the interval
+    uint64_t cycles = 0; // with a timing model, the core cycles it took
+};
+
+/*
+    Splits a run into fixed-length intervals of instructions, for the
+    sampling modes. With --bbv every interval runs functionally (no cache
+    model) while a basic block vector is collected for it; with --simpoints
+    only the scheduled intervals go through the cache model and their
+    statistics are kept; with --smarts every period-th interval is measured
+    and the rest only warm the cache tags. With interval 0, a plain run, every instruction
+    is simulated in detail and the per-instruction cost is one test.
+*/
+struct Sampling
+{
+    uint64_t interval = 0; // instructions per interval; 0 disables sampling
+    uint64_t left = 0; // instructions still to run in the current interval
+    uint64_t current = 0; // index of the current interval
+    bool started = false; // whether the first interval has begun
+    bool detailed = true; // whether lw and sw of the current interval go through the cache model
+
+    // --bbv: per-interval basic block vectors, randomly projected for clustering
+    vector<uint32_t> block_of; // static basic block id of every address; empty unless collecting
+    vector<uint64_t> bbv; // instructions executed per block in the current interval
+    vector<vector<double>> projection; // projection[d][block], the random projection matrix
+    vector<vector<double>> projected; // one projected, normalized vector per finished interval
+    ostream* bb_out = nullptr; // where to write the raw vectors, in SimPoint's .bb format
+
+    // --simpoints: which intervals to simulate in detail, and what they saw
+    vector<char> schedule; // schedule[i] is nonzero if interval i is detailed
+    vector<LevelTotals> start_totals; // cache totals when the current interval began
+    vector<IntervalStats> stats; // one per detailed interval, in order
+
+    // --smarts: periodic detailed intervals with functional warming between them
+    uint64_t period = 0; // if not 0, the last interval of every period intervals is detailed instead of following schedule
+    bool warm_between = false; // intervals that are not detailed still update the cache tags, unlogged
+    const uint64_t* clock = nullptr; // with --ooo, the core's cycle count, so detailed intervals record their cycles
+    uint64_t start_cycle = 0; // *clock when the current interval began
 };
 
 /*
@@ -74,6 +455,75 @@ void print_cache_config(const string &cache_name, int size, int assoc, int block
         ", rows " << num_rows << endl;
 }
 
+/*
+    Parses the DRAM part of a cache config: up to six comma-separated
+    fields, BANKS,ROW_WORDS,open|closed,tRCD,tCAS,tRP, each overriding its
+    default in order.
+
+    @return false if a field is malformed
+*/
+bool parse_dram_config(const string& text, DramConfig& config)
+{
+    vector<string> fields;
+    size_t start = 0;
+    while (!text.empty())
+    {
+        size_t comma = text.find(',', start);
+        fields.push_back(text.substr(start, comma == string::npos ? string::npos : comma - start));
+        if (comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    if (fields.size() > 6)
+        return false;
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        if (i == 2)
+        {
+            if (fields[i] != "open" && fields[i] != "closed")
+                return false;
+            config.open_page = fields[i] == "open";
+            continue;
+        }
+        if (fields[i].empty() || fields[i].find_first_not_of("0123456789") != string::npos || fields[i].size() > 6)
+            return false;
+        int value = stoi(fields[i]);
+        if (i == 0)
+            config.banks = value;
+        else if (i == 1)
+            config.row_words = value;
+        else if (i == 3)
+            config.tRCD = value;
+        else if (i == 4)
+            config.tCAS = value;
+        else
+            config.tRP = value;
+    }
+    return config.banks > 0 && config.row_words > 0;
+}
+
+void print_dram_config(const DramConfig& config) {
+    cout << "DRAM has " << config.banks << " banks, rows of " << config.row_words << " words, " <<
+        (config.open_page ? "open" : "closed") << " page, tRCD " << config.tRCD <<
+        ", tCAS " << config.tCAS << ", tRP " << config.tRP << endl;
+}
+
+/*
+    Prints the DRAM's request counts, row-buffer hit rate and the average
+    latency of a last-level miss.
+*/
+void print_dram_stats(const Cache& a_cache) {
+    for (size_t i = 0; i < a_cache.dram.size(); i++)
+    {
+        const Dram& dram = a_cache.dram[i];
+        uint64_t requests = dram.row_hits + dram.row_empty + dram.row_conflicts;
+        cout << "DRAM reads " << dram.reads << ", writes " << dram.writes <<
+            ", row-buffer hits " << dram.row_hits << " (" << (requests == 0 ? 0.0 : 100.0 * dram.row_hits / requests) << "%)" <<
+            ", empty " << dram.row_empty << ", conflicts " << dram.row_conflicts <<
+            ", average miss latency " << (dram.reads == 0 ? 0.0 : (double)dram.read_latency / dram.reads) << " cycles" << endl;
+    }
+}
+
 /*
     Prints out a correctly-formatted log entry.
 
@@ -99,80 +549,97 @@ void print_log_entry(const string& cache_name, const string& status, uint16_t pc
 }
 
 /*
-    Loads an E20 machine code file into the list
-    provided by mem. Assume that mem is
-    large enough to hold the values in the machine
-    code file.
+    Finds tag among the associativity tags of one row.
 
-    @param f Open file to read from
-    @param mem Array represetnting memory into which to read program
+    @return The block index holding it, or -1 if the row does not hold it
 */
-void load_machine_code(ifstream &f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
-        }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
-        }
-        expectedaddr ++;
-        mem[addr] = instr;
+int find_tag_scalar(const uint16_t tags[], int associativity, uint16_t tag)
+{
+    for (int i = 0; i < associativity; i++)
+    {
+        if (tags[i] == tag)
+            return i;
     }
+    return -1;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
 /*
-    Prints the current state of the simulator, including
-    the current program counter, the current register values,
-    and the first memquantity elements of memory.
-
-    @param pc The final value of the program counter
-    @param regs Final value of all registers
-    @param memory Final value of memory
-    @param memquantity How many words of memory to dump
+    find_tag_scalar() eight tags per compare: the movemask has two bits per
+    tag, and the lowest set bit within the row is the first match.
 */
-void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity) {
-    cout << setfill(' ');
-    cout << "Final state:" << endl;
-    cout << "\tpc=" <<setw(5)<< pc << endl;
-
-    for (size_t reg=0; reg<NUM_REGS; reg++)
-        cout << "\t$" << reg << "="<<setw(5)<<regs[reg]<<endl;
-
-    cout << setfill('0');
-    bool cr = false;
-    for (size_t count=0; count<memquantity; count++) {
-        cout << hex << setw(4) << memory[count] << " ";
-        cr = true;
-        if (count % 8 == 7) {
-            cout << endl;
-            cr = false;
-        }
+__attribute__((target("sse2")))
+int find_tag_sse2(const uint16_t tags[], int associativity, uint16_t tag)
+{
+    __m128i wanted = _mm_set1_epi16((short)tag);
+    for (int i = 0; i < associativity; i += 8)
+    {
+        __m128i row = _mm_loadu_si128((const __m128i*)(tags + i));
+        uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi16(row, wanted));
+        if (associativity - i < 8)
+            equal &= (1u << (2 * (associativity - i))) - 1; // ignore the padding past the last block
+        if (equal != 0)
+            return i + __builtin_ctz(equal) / 2;
     }
-    if (cr)
-        cout << endl;
+    return -1;
 }
 
-void sign_extend7_func(uint16_t& imm7)
+// find_tag_sse2() sixteen tags per compare, a whole row up to associativity 16
+__attribute__((target("avx2")))
+int find_tag_avx2(const uint16_t tags[], int associativity, uint16_t tag)
 {
-    if ((imm7 >> 6) == 1) //msb of the imm7 is set, aka is 1, so imm7 < 0; Sign extend
+    __m256i wanted = _mm256_set1_epi16((short)tag);
+    for (int i = 0; i < associativity; i += 16)
     {
-        imm7 = imm7 | 65408;
+        __m256i row = _mm256_loadu_si256((const __m256i*)(tags + i));
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi16(row, wanted));
+        if (associativity - i < 16)
+            equal &= (1u << (2 * (associativity - i))) - 1;
+        if (equal != 0)
+            return i + __builtin_ctz(equal) / 2;
     }
+    return -1;
+}
+#endif
+
+typedef int (*FindTag)(const uint16_t tags[], int associativity, uint16_t tag);
+
+// @return The widest find_tag that the CPU running us supports
+FindTag pick_find_tag()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_tag_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_tag_sse2;
+#endif
+    return find_tag_scalar;
+}
+
+FindTag const static find_tag = pick_find_tag(); // chosen once, at startup
+
+/*
+    Makes the block at index the row's most recently used (its last),
+    holding tag; the blocks after it move one toward the front. Index 0,
+    the least recently used block, is the one a miss replaces.
+*/
+void use_block(uint16_t tags[], int associativity, int index, uint16_t tag)
+{
+    memmove(tags + index, tags + index + 1, (associativity - index - 1) * sizeof(uint16_t));
+    tags[associativity - 1] = tag;
 }
 
-void cache_func(uint16_t address, uint16_t index, Cache& a_cache, vector<int>& parts, bool is_store_word)
+/*
+    Sends one lw or sw through the cache levels and, with a DRAM model,
+    its last-level miss (or, the caches being write-through, its store)
+    on to DRAM.
+
+    @param now Instructions executed so far, for the DRAM's clock
+    @return Cycles until a lw's data arrives, from the level latencies and
+        the memory behind them
+*/
+uint64_t cache_func(uint16_t address, uint16_t index, Cache& a_cache, vector<int>& parts, bool is_store_word, uint64_t now)
 {
     // initialzie all ints to 0 because non-initialized ints are undefined
     uint16_t l1size = 0;
@@ -227,121 +694,230 @@ void cache_func(uint16_t address, uint16_t index, Cache& a_cache, vector<int>& p
         l2tag = l2blockid / l2rows;
     }
 
-    bool l1tag_was_found = false; // a bool that can track whether a tag was found in L1
-    size_t l1tag_block_index; // a size_t that can keep track of which block in the row the tag was found in
-
-    for (size_t i = 0; i < a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.size(); i++)
-    {
-        if (a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec[i].tag == l1tag) // check if the tag stored is the tag calculated
-            {
-                l1tag_was_found = true; // tag was found, so make it true;
-                l1tag_block_index = i; // set tag index to the blcok index in which it was found
-                break;
-            }
-    }
+    Row& l1row = a_cache.levels_vec[0].rows_vec[l1row_num];
+    uint16_t* l1tags = a_cache.levels_vec[0].row_tags(l1row_num); // the row's tags, compared all at once
+    int l1tag_block_index = find_tag(l1tags, l1row.associativity, l1tag); // which block in the row the tag was found in, or -1
+    bool l1tag_was_found = l1tag_block_index >= 0; // a bool that can track whether a tag was found in L1
 
     // if it was never found, it remains false
-    if (is_store_word)
-    {
-        print_log_entry("L1", "SW", index, address, l1row_num);
-    }
-    else
+    if (a_cache.log_accesses)
     {
-        if (l1tag_was_found) // if the tag was found
+        if (is_store_word)
         {
-            print_log_entry("L1", "HIT", index, address, l1row_num);
+            print_log_entry("L1", "SW", index, address, l1row_num);
         }
-        else // if the tag was never found
+        else
         {
-            print_log_entry("L1", "MISS", index, address, l1row_num);
+            if (l1tag_was_found) // if the tag was found
+            {
+                print_log_entry("L1", "HIT", index, address, l1row_num);
+            }
+            else // if the tag was never found
+            {
+                print_log_entry("L1", "MISS", index, address, l1row_num);
+            }
         }
     }
 
     // Update L1 cache
     if (l1tag_was_found) // if the tag was found in the l1 cache; HIT
-    {   
-        // erase the first element of the vector and push_back into the vector
-        a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.erase(a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.begin() + l1tag_block_index); //erase the first element
-        Block a_block;
-        a_block.tag = l1tag;
-        a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.push_back(a_block);
-        // the current_num_of_blocks does not change
+    {
+        // move the block to the most recently used end of the row
+        use_block(l1tags, l1row.associativity, l1tag_block_index, l1tag);
+        l1row.hits++;
     }
     else // if the tag was not found in the l1 cache; MISS
     {
-        a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.erase(a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.begin());
-        Block a_block;
-        a_block.tag = l1tag;
-        a_cache.levels_vec[0].rows_vec[l1row_num].blocks_vec.push_back(a_block);
+        l1row.misses++;
+        if (l1tags[0] != (uint16_t)-1) // the least recently used block held data
+        {
+            l1row.evictions++;
+        }
+        use_block(l1tags, l1row.associativity, 0, l1tag); // replace the least recently used block
+    }
+
+    uint64_t latency = a_cache.levels_vec[0].latency;
+    if (a_cache.levels_vec.size() == 1)
+    {
+        if (is_store_word && !a_cache.dram.empty())
+            a_cache.dram[0].write(address, now);
+        else if (!is_store_word && !l1tag_was_found)
+            latency += a_cache.dram.empty() ? a_cache.memory_latency : a_cache.dram[0].read(address, now);
     }
 
     if (a_cache.levels_vec.size() == 2 && (!l1tag_was_found || is_store_word)) // if the L1 and L2 cache is available; If L2 is available becuase L1 will always be available, and if l1 tag was not found
     {
-        bool l2tag_was_found = false; // a bool that can track whether a tag was found in L2
-        size_t l2tag_block_index; // a size_t that can keep track of which block in the row the tag was found in 
+        Row& l2row = a_cache.levels_vec[1].rows_vec[l2row_num];
+        uint16_t* l2tags = a_cache.levels_vec[1].row_tags(l2row_num);
+        int l2tag_block_index = find_tag(l2tags, l2row.associativity, l2tag); // which block in the row the tag was found in, or -1
+        bool l2tag_was_found = l2tag_block_index >= 0; // a bool that can track whether a tag was found in L2
 
-        for (size_t i = 0; i < a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.size(); i++)
+        if (a_cache.log_accesses)
         {
-            if (a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec[i].tag == l2tag) // check if the tag stored is the tag calculated
+            if (is_store_word)
+            {
+                print_log_entry("L2", "SW", index, address, l2row_num);
+            }
+            else // if it is not store word, it is load word
+            {
+                // if l2 tag was found, l2tag_was_found is true
+                if (l2tag_was_found)
                 {
-                    l2tag_was_found = true; // tag was found, so make it true;
-                    l2tag_block_index = i; // set tag index to the blcok index in which it was found
-                    break;
+                    print_log_entry("L2", "HIT", index, address, l2row_num);
                 }
+                else // if l2tag was never found, it will still remain false
+                {
+                    print_log_entry("L2", "MISS", index, address, l2row_num);
+                }
+            }
         }
-
-        if (is_store_word)
+        // update L2 cache
+        if (l2tag_was_found) // if the l2 tag was found in L2 cache; HIT
         {
-            print_log_entry("L2", "SW", index, address, l2row_num);
+            use_block(l2tags, l2row.associativity, l2tag_block_index, l2tag);
+            l2row.hits++;
         }
-        else // if it is not store word, it is load word
+        else // if the l2 tag was not found in the L2 cache; MISS
         {
-            // if l2 tag was found, l2tag_was_found is true
-            if (l2tag_was_found)
+            l2row.misses++;
+            if (l2tags[0] != (uint16_t)-1)
             {
-                print_log_entry("L2", "HIT", index, address, l2row_num);
-            }
-            else // if l2tag was never found, it will still remain false
-            {
-                print_log_entry("L2", "MISS", index, address, l2row_num);
+                l2row.evictions++;
             }
+            use_block(l2tags, l2row.associativity, 0, l2tag);
         }
-        // update L2 cache
-        if (l2tag_was_found) // if the l2 tag was found in L2 cache; HIT
+
+        latency += a_cache.levels_vec[1].latency;
+        if (is_store_word && !a_cache.dram.empty())
+            a_cache.dram[0].write(address, now);
+        else if (!is_store_word && !l2tag_was_found)
+            latency += a_cache.dram.empty() ? a_cache.memory_latency : a_cache.dram[0].read(address, now);
+    }
+    return latency;
+}
+
+/*
+    Sums the hit, miss and eviction counters of every row, per level.
+*/
+vector<LevelTotals> cache_totals(const Cache& a_cache)
+{
+    vector<LevelTotals> totals(a_cache.levels_vec.size());
+    for (size_t level = 0; level < a_cache.levels_vec.size(); level++)
+    {
+        for (size_t row = 0; row < a_cache.levels_vec[level].rows_vec.size(); row++)
         {
-            // erase first element, then push_back into the vector
-            a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.erase(a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.begin() + l2tag_block_index);
-            Block a_block;
-            a_block.tag = l2tag;
-            a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.push_back(a_block);
+            const Row& a_row = a_cache.levels_vec[level].rows_vec[row];
+            totals[level].hits += a_row.hits;
+            totals[level].misses += a_row.misses;
+            totals[level].evictions += a_row.evictions;
         }
-        else // if the l2 tag was not found in the L2 cache; MISS
+    }
+    return totals;
+}
+
+/*
+    Closes the current interval, if one has begun, and starts the next.
+    Called before the first instruction of every interval and once more
+    after the halt, which closes the last, possibly short, interval.
+*/
+void next_interval(Sampling& sampling, const Cache& a_cache)
+{
+    if (sampling.started)
+    {
+        uint64_t instructions = sampling.interval - sampling.left;
+        if (!sampling.block_of.empty())
         {
-            a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.erase(a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.begin());
-            Block a_block;
-            a_block.tag = l2tag;
-            a_cache.levels_vec[1].rows_vec[l2row_num].blocks_vec.push_back(a_block);
+            // SimPoint weights each block by the instructions executed in it, normalized per interval
+            vector<double> point(sampling.projection.size(), 0.0);
+            if (sampling.bb_out != nullptr)
+                *sampling.bb_out << "T";
+            for (size_t block = 0; block < sampling.bbv.size(); block++)
+            {
+                if (sampling.bbv[block] == 0)
+                    continue;
+                double frequency = (double)sampling.bbv[block] / instructions;
+                for (size_t d = 0; d < point.size(); d++)
+                    point[d] += frequency * sampling.projection[d][block];
+                if (sampling.bb_out != nullptr)
+                    *sampling.bb_out << ":" << block + 1 << ":" << sampling.bbv[block] << " ";
+                sampling.bbv[block] = 0;
+            }
+            if (sampling.bb_out != nullptr)
+                *sampling.bb_out << endl;
+            sampling.projected.push_back(point);
+        }
+        if (sampling.detailed)
+        {
+            IntervalStats stats;
+            stats.interval = sampling.current;
+            stats.instructions = instructions;
+            stats.levels = cache_totals(a_cache);
+            for (size_t level = 0; level < stats.levels.size(); level++)
+            {
+                stats.levels[level].hits -= sampling.start_totals[level].hits;
+                stats.levels[level].misses -= sampling.start_totals[level].misses;
+                stats.levels[level].evictions -= sampling.start_totals[level].evictions;
+            }
+            if (sampling.clock != nullptr)
+                stats.cycles = *sampling.clock - sampling.start_cycle;
+            sampling.stats.push_back(stats);
         }
+        sampling.current++;
+    }
+    sampling.started = true;
+    sampling.left = sampling.interval;
+    if (sampling.period != 0)
+        sampling.detailed = sampling.current % sampling.period == sampling.period - 1;
+    else
+        sampling.detailed = sampling.current < sampling.schedule.size() && sampling.schedule[sampling.current];
+    if (sampling.detailed)
+    {
+        sampling.start_totals = cache_totals(a_cache);
+        if (sampling.clock != nullptr)
+            sampling.start_cycle = *sampling.clock;
     }
 }
 
-int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Cache& a_cache, vector<int>& parts) {
-    bool halt = false;
+/*
+    Runs the E20 program held in memory_arr until it halts, sending every
+    lw and sw through the cache model (only in detailed intervals, when
+    sampling).
+
+    @param state The pc and registers to start from, updated in place; its
+        status says why the run stopped (STATUS_RUNNING if only max_steps
+        ran out) and its illegal policy applies to undefined instructions
+    @return The number of instructions executed, including the halt
+*/
+size_t run_e20_simulator(MachineState& state, uint16_t* memory_arr, Cache& a_cache, vector<int>& parts, Analysis& analysis, Sampling& sampling, size_t max_steps = SIZE_MAX) {
+    uint16_t* regs_arr = state.regs_arr;
+    uint16_t& pc = state.pc;
+    size_t steps = 0;
+    Status status = STATUS_RUNNING;
 
-    while (!halt)
+    while (status == STATUS_RUNNING && steps < max_steps)
     {
+        steps++;
         uint16_t index = pc % MEM_SIZE; // pc is 16-bit unsigned integer, MEM_SIZE is 13-bit; this always makes sure pc < MEM_SIZE. If PC > MEM_SIZE, modulus forces pc to wrap around to 0
         uint16_t instruction = memory_arr[index]; //indexes memory_arr at index; will never be out of range due to line above, and will always loop over and over without a problem
 
-        // Extract all possible combinations
+        if (sampling.interval != 0)
+        {
+            if (sampling.left == 0)
+                next_interval(sampling, a_cache);
+            sampling.left--;
+            if (!sampling.block_of.empty())
+                sampling.bbv[sampling.block_of[index]]++;
+        }
+
+        // Look up all possible combinations, already extracted in decode_table
+        const Decoded& fields = decode_table[instruction];
         uint16_t opcode = instruction >> 13;
-        uint16_t bits10_12 = (instruction >> 10) & 7;
-        uint16_t bits7_9 = (instruction >> 7) & 7;
-        uint16_t bits4_6 = (instruction >> 4) & 7;
+        uint16_t bits10_12 = fields.reg_a;
+        uint16_t bits7_9 = fields.reg_b;
+        uint16_t bits4_6 = fields.reg_dst;
         uint16_t bits0_3 = instruction & 15;
-        uint16_t bits0_6 = instruction & 127;
-        uint16_t bits0_12 = instruction & 8191;
-        sign_extend7_func(bits0_6);
+        uint16_t bits0_6 = fields.imm; // sign-extended imm7, but for j and jal...
+        uint16_t bits0_12 = fields.imm; // ...the 13-bit target
 
 
         if (opcode == 0) //add, sub, or, and, slt, jr, 
@@ -386,6 +962,12 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
             else if (bits0_3 == 8) //jr
             {
                 pc = regs_arr[bits10_12];
+                status = poll_limits(state, state.executed + steps);
+            }
+
+            else // undefined function code
+            {
+                status = raise_illegal(state);
             }
 
             regs_arr[0] = 0; //ensures that the zero register is always 0
@@ -402,7 +984,11 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
         {
             if (pc == bits0_12) //if pc will jump to itself
             {
-                halt = true; //set halt to be true to stop loop
+                status = STATUS_HALTED; //set status to halted to stop loop
+            }
+            else
+            {
+                status = poll_limits(state, state.executed + steps);
             }
             pc = bits0_12;
         }
@@ -411,12 +997,21 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
         {
             regs_arr[7] = pc + 1;
             pc = bits0_12;
+            status = poll_limits(state, state.executed + steps);
         }
 
         else if (opcode == 4) //lw
         {   // Always run this block of code
             uint16_t address = (regs_arr[bits10_12] + bits0_6) % MEM_SIZE; 
-            cache_func(address, index, a_cache, parts, false);
+            if (sampling.detailed)
+            {
+                cache_func(address, index, a_cache, parts, false, steps);
+                record_access(analysis, address, false);
+            }
+            else if (sampling.warm_between)
+            {
+                cache_func(address, index, a_cache, parts, false, steps); // functional warming; only the tags matter
+            }
             regs_arr[bits7_9] = memory_arr[address];
             regs_arr[0] = 0; //ensures that the zero register is always 0
             pc+=1;
@@ -425,7 +1020,15 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
         else if (opcode == 5) //sw
         {
             uint16_t address = (regs_arr[bits10_12] + bits0_6) % MEM_SIZE;
-            cache_func(address, index, a_cache, parts, true);
+            if (sampling.detailed)
+            {
+                cache_func(address, index, a_cache, parts, true, steps);
+                record_access(analysis, address, true);
+            }
+            else if (sampling.warm_between)
+            {
+                cache_func(address, index, a_cache, parts, true, steps); // functional warming; only the tags matter
+            }
             memory_arr[address] = regs_arr[bits7_9];
             pc+=1;
         }
@@ -440,6 +1043,7 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
             {
                 pc+=1;
             }
+            status = poll_limits(state, state.executed + steps);
         }
 
         else if (opcode == 7) //slti
@@ -455,13 +1059,1529 @@ int run_e20_simulator(uint16_t regs_arr[], uint16_t pc, uint16_t* memory_arr, Ca
             regs_arr[0] = 0;
             pc+=1;
         }
+
+        // straight-line code that wraps past the top of memory has no control transfer to poll at
+        if (status == STATUS_RUNNING && (state.executed + steps) % MEM_SIZE == 0)
+            status = poll_limits(state, state.executed + steps);
     }
 
-    return 0;
-}
+    if (sampling.interval != 0)
+        next_interval(sampling, a_cache); // close the last interval
 
+    state.status = status;
+    state.executed += steps;
+    return steps;
+}
 
-/**
+/*
+    Where detailed simulation starts. The first instructions (or those up
+    to a marker pc) run on the predecoded engine with no cache model; then
+    a warming window updates the cache tags without logging or counting
+    anything, so the detailed part does not start from a cold cache.
+*/
+struct FastForward
+{
+    size_t instructions = 0; // how many instructions to fast-forward
+    int stop_pc = -1; // if not -1, fast-forward until pc reaches this instead
+    size_t warming = 0; // instructions of functional cache warming after the fast-forward
+};
+
+/*
+    Clears the hit, miss and eviction counters of every row, and the DRAM
+    counters, keeping the tags and the open DRAM rows.
+*/
+void reset_row_counters(Cache& a_cache)
+{
+    for (size_t i = 0; i < a_cache.dram.size(); i++)
+    {
+        Dram& dram = a_cache.dram[i];
+        dram.reads = dram.writes = dram.row_hits = dram.row_empty = dram.row_conflicts = 0;
+        dram.read_latency = 0;
+    }
+    for (size_t level = 0; level < a_cache.levels_vec.size(); level++)
+    {
+        for (size_t row = 0; row < a_cache.levels_vec[level].rows_vec.size(); row++)
+        {
+            Row& a_row = a_cache.levels_vec[level].rows_vec[row];
+            a_row.hits = 0;
+            a_row.misses = 0;
+            a_row.evictions = 0;
+        }
+    }
+}
+
+/*
+    Fast-forwards and warms as ff asks, then simulates the rest of the
+    program in detail.
+
+    @param state As for run_e20_simulator(), across all three phases
+    @return The number of instructions executed in all three phases
+*/
+size_t run_fast_forward(const FastForward& ff, MachineState& state, uint16_t* memory_arr, Cache& a_cache, vector<int>& parts, Analysis& analysis, Sampling& sampling) {
+    size_t steps = 0;
+    if (ff.instructions > 0 || ff.stop_pc >= 0)
+    {
+        vector<Machine> machine(1);
+        machine[0].reset();
+        static_cast<MachineState&>(machine[0]) = state;
+        memcpy(machine[0].memory_arr, memory_arr, sizeof(machine[0].memory_arr));
+        vector<Decoded> decoded(MEM_SIZE);
+        predecode(machine[0].memory_arr, decoded.data());
+        steps = run_predecoded(machine[0], decoded.data(), ff.stop_pc, ff.stop_pc >= 0 ? SIZE_MAX : ff.instructions);
+        state = machine[0];
+        memcpy(memory_arr, machine[0].memory_arr, sizeof(machine[0].memory_arr));
+        if (state.status == STATUS_HALTED)
+        {
+            cerr << "Program halted after " << steps << " instructions, during the fast-forward" << endl;
+            return steps;
+        }
+        if (state.status != STATUS_RUNNING)
+            return steps;
+    }
+
+    if (ff.warming > 0)
+    {
+        bool log_accesses = a_cache.log_accesses;
+        a_cache.log_accesses = false;
+        Analysis no_analysis; // warming feeds the cache only
+        Sampling no_sampling;
+        steps += run_e20_simulator(state, memory_arr, a_cache, parts, no_analysis, no_sampling, ff.warming);
+        a_cache.log_accesses = log_accesses;
+        reset_row_counters(a_cache);
+        if (state.status == STATUS_HALTED)
+        {
+            cerr << "Program halted after " << steps << " instructions, during the cache warming" << endl;
+            return steps;
+        }
+        if (state.status != STATUS_RUNNING) // stopped on an illegal instruction or a limit, which main reports
+            return steps;
+    }
+
+    return steps + run_e20_simulator(state, memory_arr, a_cache, parts, analysis, sampling);
+}
+
+/*
+    Writes the memory and cache-row heatmaps collected during a run as two
+    CSV files: PREFIX.mem.csv with one line per word that was read or written,
+    and PREFIX.rows.csv with hit, miss and eviction counts for every row of
+    every level.
+
+    @param prefix Path prefix for both files; nothing is written if empty
+*/
+void write_heatmap(const string& prefix, const Cache& a_cache, const Analysis& analysis) {
+    if (prefix.empty())
+        return;
+
+    ofstream mem_out(prefix + ".mem.csv");
+    ofstream rows_out(prefix + ".rows.csv");
+    if (!mem_out.is_open() || !rows_out.is_open()) {
+        cerr << "Can't write heatmap " << prefix << endl;
+        return;
+    }
+
+    mem_out << "addr,reads,writes" << endl;
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+    {
+        if (analysis.word_reads[addr] != 0 || analysis.word_writes[addr] != 0) // skip untouched words to keep the file compact
+        {
+            mem_out << addr << "," << analysis.word_reads[addr] << "," << analysis.word_writes[addr] << endl;
+        }
+    }
+
+    rows_out << "level,row,hits,misses,evictions" << endl;
+    for (size_t level = 0; level < a_cache.levels_vec.size(); level++)
+    {
+        for (size_t row = 0; row < a_cache.levels_vec[level].rows_vec.size(); row++)
+        {
+            const Row& a_row = a_cache.levels_vec[level].rows_vec[row];
+            rows_out << "L" << level + 1 << "," << row << "," << a_row.hits << "," << a_row.misses << "," << a_row.evictions << endl;
+        }
+    }
+}
+
+/*
+    Writes the reuse-distance analysis as three CSV files:
+    PREFIX.reuse.csv, the reuse-distance histogram per blocksize (distance -1
+    counts cold accesses); PREFIX.missrate.csv, the miss rate a fully
+    associative LRU cache of each power-of-two number of blocks would have
+    on this access stream; and PREFIX.ws.csv, the working-set size of each
+    window, in blocks, per blocksize.
+
+    @param prefix Path prefix for the files; nothing is written if empty
+*/
+void write_reuse(const string& prefix, const Analysis& analysis) {
+    if (prefix.empty())
+        return;
+
+    ofstream reuse_out(prefix + ".reuse.csv");
+    ofstream miss_out(prefix + ".missrate.csv");
+    ofstream ws_out(prefix + ".ws.csv");
+    if (!reuse_out.is_open() || !miss_out.is_open() || !ws_out.is_open()) {
+        cerr << "Can't write reuse analysis " << prefix << endl;
+        return;
+    }
+
+    reuse_out << "blocksize,distance,count" << endl;
+    miss_out << "blocksize,blocks,size,miss_rate" << endl;
+    for (size_t i = 0; i < analysis.reuse.size(); i++)
+    {
+        const ReuseDistance& rd = analysis.reuse[i];
+        reuse_out << rd.blocksize << ",-1," << rd.cold << endl;
+        for (size_t d = 0; d < rd.histogram.size(); d++)
+        {
+            if (rd.histogram[d] != 0)
+                reuse_out << rd.blocksize << "," << d << "," << rd.histogram[d] << endl;
+        }
+
+        // an access hits in an LRU cache of n blocks exactly when its reuse distance is below n
+        uint64_t hits = 0;
+        size_t d = 0;
+        for (size_t blocks = 1; blocks <= rd.histogram.size(); blocks *= 2)
+        {
+            for (; d < blocks; d++)
+                hits += rd.histogram[d];
+            double miss_rate = rd.accesses == 0 ? 0.0 : (double)(rd.accesses - hits) / rd.accesses;
+            miss_out << rd.blocksize << "," << blocks << "," << blocks * rd.blocksize << "," << miss_rate << endl;
+        }
+    }
+
+    ws_out << "window,first_access";
+    for (size_t i = 0; i < analysis.working_sets.size(); i++)
+        ws_out << ",blocksize_" << analysis.working_sets[i].blocksize;
+    ws_out << endl;
+    size_t windows = analysis.working_sets.empty() ? 0 : analysis.working_sets[0].sizes.size();
+    for (size_t w = 0; w < windows; w++)
+    {
+        ws_out << w << "," << w * analysis.ws_window;
+        for (size_t i = 0; i < analysis.working_sets.size(); i++)
+            ws_out << "," << analysis.working_sets[i].sizes[w];
+        ws_out << endl;
+    }
+}
+
+/*
+    Splits memory into static basic blocks for the basic block vectors. A
+    block starts at address 0, at every j, jal and jeq target, and after
+    every control transfer (j, jal, jr, jeq). jr targets are only known at
+    run time, but a return lands after a jal, which already starts a block.
+
+    @param num_blocks Set to the number of blocks
+    @return The block id of every address, numbered from 0 in address order
+*/
+vector<uint32_t> basic_block_ids(const uint16_t memory_arr[], size_t& num_blocks)
+{
+    vector<char> leader(MEM_SIZE, 0);
+    leader[0] = 1;
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+    {
+        const Decoded& d = decode_table[memory_arr[addr]];
+        bool transfer = false;
+        if (d.op == OP_J || d.op == OP_JAL)
+        {
+            leader[d.imm % MEM_SIZE] = 1;
+            transfer = true;
+        }
+        else if (d.op == OP_JEQ)
+        {
+            leader[(uint16_t)(addr + 1 + d.imm) % MEM_SIZE] = 1;
+            transfer = true;
+        }
+        else if (d.op == OP_JR)
+        {
+            transfer = true;
+        }
+        if (transfer && addr + 1 < MEM_SIZE)
+            leader[addr + 1] = 1;
+    }
+
+    vector<uint32_t> block_of(MEM_SIZE);
+    uint32_t block = 0;
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+    {
+        if (leader[addr] && addr != 0)
+            block++;
+        block_of[addr] = block;
+    }
+    num_blocks = block + 1;
+    return block_of;
+}
+
+/*
+    One k-means clustering of the projected basic block vectors.
+*/
+struct Clustering
+{
+    vector<size_t> assignment; // cluster of every point
+    vector<vector<double>> centroids;
+    double distortion = 0; // sum of squared distances of the points to their centroids
+    double bic = 0;
+};
+
+double squared_distance(const vector<double>& a, const vector<double>& b)
+{
+    double sum = 0;
+    for (size_t d = 0; d < a.size(); d++)
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    return sum;
+}
+
+/*
+    Lloyd's k-means from a k-means++ seeding.
+*/
+Clustering kmeans(const vector<vector<double>>& points, size_t k, mt19937& rng)
+{
+    Clustering c;
+    c.centroids.push_back(points[uniform_int_distribution<size_t>(0, points.size() - 1)(rng)]);
+    vector<double> nearest(points.size());
+    while (c.centroids.size() < k)
+    {
+        // pick the next centroid with probability proportional to its squared distance from the chosen ones
+        double total = 0;
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            nearest[i] = squared_distance(points[i], c.centroids[0]);
+            for (size_t j = 1; j < c.centroids.size(); j++)
+                nearest[i] = min(nearest[i], squared_distance(points[i], c.centroids[j]));
+            total += nearest[i];
+        }
+        size_t chosen = 0;
+        if (total > 0)
+        {
+            double target = uniform_real_distribution<double>(0, total)(rng);
+            while (chosen + 1 < points.size() && target >= nearest[chosen])
+                target -= nearest[chosen++];
+        }
+        c.centroids.push_back(points[chosen]);
+    }
+
+    c.assignment.assign(points.size(), 0);
+    for (int iteration = 0; iteration < 100; iteration++)
+    {
+        bool changed = iteration == 0;
+        c.distortion = 0;
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            size_t best = 0;
+            double best_distance = squared_distance(points[i], c.centroids[0]);
+            for (size_t j = 1; j < k; j++)
+            {
+                double distance = squared_distance(points[i], c.centroids[j]);
+                if (distance < best_distance)
+                {
+                    best = j;
+                    best_distance = distance;
+                }
+            }
+            changed = changed || best != c.assignment[i];
+            c.assignment[i] = best;
+            c.distortion += best_distance;
+        }
+        if (!changed)
+            break;
+        vector<size_t> sizes(k, 0);
+        for (size_t j = 0; j < k; j++)
+            fill(c.centroids[j].begin(), c.centroids[j].end(), 0.0);
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            sizes[c.assignment[i]]++;
+            for (size_t d = 0; d < points[i].size(); d++)
+                c.centroids[c.assignment[i]][d] += points[i][d];
+        }
+        for (size_t j = 0; j < k; j++)
+        {
+            for (size_t d = 0; d < c.centroids[j].size() && sizes[j] != 0; d++)
+                c.centroids[j][d] /= sizes[j];
+        }
+    }
+    return c;
+}
+
+/*
+    Bayesian information criterion of a clustering, as in X-means and
+    SimPoint: the log-likelihood of the points under one spherical Gaussian
+    per cluster with a shared variance, less a penalty for the parameters.
+*/
+double bic_score(const vector<vector<double>>& points, const Clustering& c)
+{
+    double r = points.size();
+    double k = c.centroids.size();
+    double m = points[0].size();
+    double variance = max(c.distortion / (m * max(r - k, 1.0)), 1e-12);
+    vector<double> sizes(c.centroids.size(), 0);
+    for (size_t i = 0; i < c.assignment.size(); i++)
+        sizes[c.assignment[i]]++;
+    double likelihood = -r * m / 2 * log(2 * M_PI * variance) - c.distortion / (2 * variance);
+    for (size_t j = 0; j < sizes.size(); j++)
+    {
+        if (sizes[j] > 0)
+            likelihood += sizes[j] * log(sizes[j] / r);
+    }
+    double parameters = (k - 1) + k * m + 1;
+    return likelihood - parameters / 2 * log(r);
+}
+
+/*
+    Clusters the interval vectors for every k up to max_k (keeping the best
+    of a few seedings each) and, as SimPoint does, picks the smallest k
+    whose BIC reaches 90% of the way from the worst score to the best.
+*/
+Clustering choose_phases(const vector<vector<double>>& points, size_t max_k)
+{
+    mt19937 rng(1); // fixed seed: the same program always gets the same simulation points
+    vector<Clustering> candidates;
+    for (size_t k = 1; k <= min(max_k, points.size()); k++)
+    {
+        Clustering best;
+        for (int seeding = 0; seeding < 5; seeding++)
+        {
+            Clustering c = kmeans(points, k, rng);
+            if (seeding == 0 || c.distortion < best.distortion)
+                best = c;
+        }
+        best.bic = bic_score(points, best);
+        candidates.push_back(best);
+    }
+    double lowest = candidates[0].bic;
+    double highest = candidates[0].bic;
+    for (size_t i = 1; i < candidates.size(); i++)
+    {
+        lowest = min(lowest, candidates[i].bic);
+        highest = max(highest, candidates[i].bic);
+    }
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        if (candidates[i].bic >= lowest + 0.9 * (highest - lowest))
+            return candidates[i];
+    }
+    return candidates.back();
+}
+
+/*
+    Runs the program functionally, collecting a basic block vector for
+    every interval, then clusters them and writes SimPoint's files:
+    PREFIX.bb with the raw vectors, PREFIX.simpoints with one
+    "INTERVAL CLUSTER" line per representative interval (the one nearest
+    its cluster's centroid) and PREFIX.weights with "WEIGHT CLUSTER" lines,
+    the fraction of all intervals in each cluster.
+
+    @param state As for run_e20_simulator(); its status says how the run ended
+    @return false if the files could not be written
+*/
+bool write_simpoints(const string& prefix, uint64_t interval, size_t max_k, MachineState& state, uint16_t* memory_arr)
+{
+    ofstream bb_out(prefix + ".bb");
+    ofstream points_out(prefix + ".simpoints");
+    ofstream weights_out(prefix + ".weights");
+    if (!bb_out.is_open() || !points_out.is_open() || !weights_out.is_open()) {
+        cerr << "Can't write simulation points " << prefix << endl;
+        return false;
+    }
+
+    Sampling sampling;
+    sampling.interval = interval;
+    size_t num_blocks = 0;
+    sampling.block_of = basic_block_ids(memory_arr, num_blocks);
+    sampling.bbv.assign(num_blocks, 0);
+    sampling.bb_out = &bb_out;
+    const size_t dimensions = 15; // SimPoint's default projection
+    mt19937 rng(1);
+    uniform_real_distribution<double> unit(-1.0, 1.0);
+    sampling.projection.assign(dimensions, vector<double>(num_blocks));
+    for (size_t d = 0; d < dimensions; d++)
+    {
+        for (size_t block = 0; block < num_blocks; block++)
+            sampling.projection[d][block] = unit(rng);
+    }
+
+    Cache no_cache; // every interval is functional, so the cache model is never consulted
+    vector<int> no_parts;
+    Analysis analysis;
+    size_t steps = run_e20_simulator(state, memory_arr, no_cache, no_parts, analysis, sampling);
+
+    Clustering phases = choose_phases(sampling.projected, max_k);
+    size_t clusters = 0;
+    for (size_t j = 0; j < phases.centroids.size(); j++)
+    {
+        size_t representative = SIZE_MAX;
+        double best_distance = 0;
+        size_t members = 0;
+        for (size_t i = 0; i < sampling.projected.size(); i++)
+        {
+            if (phases.assignment[i] != j)
+                continue;
+            members++;
+            double distance = squared_distance(sampling.projected[i], phases.centroids[j]);
+            if (representative == SIZE_MAX || distance < best_distance)
+            {
+                representative = i;
+                best_distance = distance;
+            }
+        }
+        if (members == 0)
+            continue;
+        points_out << representative << " " << clusters << endl;
+        weights_out << (double)members / sampling.projected.size() << " " << clusters << endl;
+        clusters++;
+    }
+    cout << "Chose " << clusters << " simulation points from " << sampling.projected.size() << " intervals of " << interval << " instructions (" << steps << " instructions, " << num_blocks << " basic blocks)" << endl;
+    return true;
+}
+
+/*
+    Reads PREFIX.simpoints and PREFIX.weights as written by --bbv and
+    schedules their intervals for detailed simulation.
+
+    @param weights Set to the weight of each scheduled interval
+    @return false if the files are missing or malformed
+*/
+bool load_simpoints(const string& prefix, Sampling& sampling, map<uint64_t, double>& weights)
+{
+    ifstream points_in(prefix + ".simpoints");
+    ifstream weights_in(prefix + ".weights");
+    if (!points_in.is_open() || !weights_in.is_open()) {
+        cerr << "Can't read simulation points " << prefix << endl;
+        return false;
+    }
+    map<size_t, uint64_t> interval_of; // cluster to its representative interval
+    uint64_t interval;
+    size_t cluster;
+    while (points_in >> interval >> cluster)
+        interval_of[cluster] = interval;
+    double weight;
+    while (weights_in >> weight >> cluster)
+    {
+        if (interval_of.count(cluster) == 0) {
+            cerr << "No simulation point for cluster " << cluster << " in " << prefix << endl;
+            return false;
+        }
+        weights[interval_of[cluster]] += weight;
+    }
+    if (weights.empty()) {
+        cerr << "No simulation points in " << prefix << endl;
+        return false;
+    }
+    sampling.schedule.assign(weights.rbegin()->first + 1, 0);
+    for (map<uint64_t, double>::const_iterator it = weights.begin(); it != weights.end(); ++it)
+        sampling.schedule[it->first] = 1;
+    return true;
+}
+
+/*
+    Prints whole-program cache statistics extrapolated from the detailed
+    intervals: each point's per-instruction counts, weighted by its
+    cluster's share of the program, scaled to the full instruction count.
+*/
+void print_simpoint_estimate(const Sampling& sampling, const map<uint64_t, double>& weights, size_t steps)
+{
+    size_t num_levels = sampling.stats.empty() ? 0 : sampling.stats[0].levels.size();
+    vector<double> hits(num_levels, 0), misses(num_levels, 0), evictions(num_levels, 0);
+    double total_weight = 0; // points past the end of this run are dropped and the rest renormalized
+    uint64_t detailed = 0;
+    for (size_t i = 0; i < sampling.stats.size(); i++)
+    {
+        const IntervalStats& stats = sampling.stats[i];
+        if (stats.instructions == 0)
+            continue;
+        double weight = weights.at(stats.interval);
+        total_weight += weight;
+        detailed += stats.instructions;
+        for (size_t level = 0; level < num_levels; level++)
+        {
+            hits[level] += weight * stats.levels[level].hits / stats.instructions;
+            misses[level] += weight * stats.levels[level].misses / stats.instructions;
+            evictions[level] += weight * stats.levels[level].evictions / stats.instructions;
+        }
+    }
+    cout << "SimPoint estimate from " << sampling.stats.size() << " of " << weights.size() << " simulation points (" << detailed << " of " << steps << " instructions in detail)" << endl;
+    if (total_weight == 0)
+        return;
+    for (size_t level = 0; level < num_levels; level++)
+    {
+        double scale = steps / total_weight;
+        double accesses = (hits[level] + misses[level]) * scale;
+        cout << "L" << level + 1 << " estimated hits " << llround(hits[level] * scale) <<
+            " misses " << llround(misses[level] * scale) <<
+            " evictions " << llround(evictions[level] * scale) <<
+            " miss rate " << (accesses == 0 ? 0.0 : misses[level] * scale / accesses) << endl;
+    }
+}
+
+/*
+    Settings for SMARTS-style systematic sampling.
+*/
+struct Smarts
+{
+    uint64_t unit = 0; // instructions per detailed unit; 0 disables SMARTS
+    uint64_t period = 0; // instructions from one unit to the next; 0 to choose it from target_error
+    double target_error = 0.03; // wanted half-width of the 95% confidence interval, relative to the estimate
+};
+
+/*
+    A ratio estimate (misses over accesses, say) from sampled units, with
+    the half-width of its 95% confidence interval.
+*/
+struct RatioEstimate
+{
+    double ratio = 0;
+    double half_width = 0;
+};
+
+/*
+    Estimates sum(numerators) / sum(denominators) over the whole population
+    of units from the sampled ones. The variance is the usual ratio
+    estimator's, with the finite population correction, so measuring every
+    unit gives a zero-width interval.
+
+    @param population How many units the whole run has
+*/
+RatioEstimate estimate_ratio(const vector<double>& numerators, const vector<double>& denominators, double population)
+{
+    RatioEstimate estimate;
+    double n = numerators.size();
+    double numerator_sum = 0;
+    double denominator_sum = 0;
+    for (size_t i = 0; i < numerators.size(); i++)
+    {
+        numerator_sum += numerators[i];
+        denominator_sum += denominators[i];
+    }
+    if (denominator_sum == 0)
+        return estimate;
+    estimate.ratio = numerator_sum / denominator_sum;
+    if (n < 2)
+        return estimate;
+    double residuals = 0;
+    for (size_t i = 0; i < numerators.size(); i++)
+    {
+        double residual = numerators[i] - estimate.ratio * denominators[i];
+        residuals += residual * residual;
+    }
+    double mean_denominator = denominator_sum / n;
+    double correction = max(0.0, 1 - n / population);
+    double variance = residuals / (n - 1) / (n * mean_denominator * mean_denominator) * correction;
+    estimate.half_width = 1.96 * sqrt(variance);
+    return estimate;
+}
+
+/*
+    The registers an instruction reads and the one it writes; -1 for
+    none, and for a write to $0, which is discarded.
+*/
+struct Operands
+{
+    int sources[2] = {-1, -1};
+    int dest = -1;
+};
+
+Operands operands_of(const Decoded& d)
+{
+    Operands operands;
+    if (d.op <= OP_SLT)
+    {
+        operands.sources[0] = d.reg_a;
+        operands.sources[1] = d.reg_b;
+        operands.dest = d.reg_dst;
+    }
+    else if (d.op == OP_ADDI || d.op == OP_SLTI || d.op == OP_LW)
+    {
+        operands.sources[0] = d.reg_a;
+        operands.dest = d.reg_b;
+    }
+    else if (d.op == OP_SW || d.op == OP_JEQ)
+    {
+        operands.sources[0] = d.reg_a;
+        operands.sources[1] = d.reg_b;
+    }
+    else if (d.op == OP_JR)
+        operands.sources[0] = d.reg_a;
+    else if (d.op == OP_JAL)
+        operands.dest = NUM_REGS - 1;
+    if (operands.dest == 0)
+        operands.dest = -1;
+    return operands;
+}
+
+/*
+    The direction predictors for jeq, selectable by name.
+*/
+enum Predictor
+{
+    PREDICTOR_BIMODAL,
+    PREDICTOR_GSHARE,
+    PREDICTOR_TAKEN,
+    PREDICTOR_NOT_TAKEN,
+    NUM_PREDICTORS
+};
+
+const char* predictor_name(Predictor predictor)
+{
+    static const char* names[NUM_PREDICTORS] = {"bimodal", "gshare", "taken", "not-taken"};
+    return names[predictor];
+}
+
+// @return false if name is not a predictor
+bool parse_predictor(const string& name, Predictor& predictor)
+{
+    for (int p = 0; p < NUM_PREDICTORS; p++)
+    {
+        if (name == predictor_name((Predictor)p))
+        {
+            predictor = (Predictor)p;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Parameters of the out-of-order timing model.
+*/
+struct CoreConfig
+{
+    size_t fetch_width = 4; // instructions fetched, and dispatched, per cycle
+    size_t issue_width = 4;
+    size_t commit_width = 4;
+    size_t rob_size = 64;
+    size_t iq_size = 32;
+    size_t prf_size = 64; // physical registers, the architectural mappings included
+    size_t lsq_size = 32;
+    uint64_t depth = 3; // cycles from fetch to dispatch, so also the refill after a redirect
+    Predictor predictor = PREDICTOR_BIMODAL; // for jeq
+    int predictor_bits = 10; // log2 of the number of two-bit counters
+    size_t ras_size = 16; // return-address stack entries for predicting jr; 0 for none
+    uint64_t l1_latency = 2;
+    uint64_t l2_latency = 12;
+    uint64_t memory_latency = 100; // cycles for a last-level miss without a DRAM model
+};
+
+/*
+    Parses the --ooo argument, a comma-separated list of KEY=VALUE
+    settings; keys left out keep their defaults.
+
+    @return false on an unknown key or a bad value
+*/
+bool parse_core_config(const string& text, CoreConfig& config)
+{
+    size_t start = 0;
+    while (!text.empty())
+    {
+        size_t comma = text.find(',', start);
+        string field = text.substr(start, comma == string::npos ? string::npos : comma - start);
+        size_t equals = field.find('=');
+        if (equals == string::npos)
+            return false;
+        string key = field.substr(0, equals);
+        string value = field.substr(equals + 1);
+        if (key == "bp")
+        {
+            if (!parse_predictor(value, config.predictor))
+                return false;
+        }
+        else if (key == "bp-bits")
+        {
+            if (!parse_number(value, config.predictor_bits, 0, 20))
+                return false;
+        }
+        else
+        {
+            size_t number;
+            if (!parse_number(value, number, key == "ras" ? 0 : 1)) // only the return-address stack may be left out
+                return false;
+            if (key == "width")
+                config.fetch_width = config.issue_width = config.commit_width = number;
+            else if (key == "fetch")
+                config.fetch_width = number;
+            else if (key == "issue")
+                config.issue_width = number;
+            else if (key == "commit")
+                config.commit_width = number;
+            else if (key == "rob")
+                config.rob_size = number;
+            else if (key == "iq")
+                config.iq_size = number;
+            else if (key == "prf")
+                config.prf_size = number;
+            else if (key == "lsq")
+                config.lsq_size = number;
+            else if (key == "depth")
+                config.depth = number;
+            else if (key == "ras")
+                config.ras_size = number;
+            else if (key == "l1")
+                config.l1_latency = number;
+            else if (key == "l2")
+                config.l2_latency = number;
+            else if (key == "mem")
+                config.memory_latency = number;
+            else
+                return false;
+        }
+        if (comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    return config.prf_size > NUM_REGS;
+}
+
+/*
+    Direction predictor for jeq: a table of two-bit saturating counters
+    indexed by pc (bimodal) or by pc xor the global history (gshare), or
+    a static guess.
+*/
+struct BranchPredictor
+{
+    BranchPredictor(Predictor kind, int bits) : kind(kind), counters(1 << bits, 1), mask((1 << bits) - 1) {}
+
+    bool predict(uint16_t pc) const
+    {
+        if (kind == PREDICTOR_TAKEN)
+            return true;
+        if (kind == PREDICTOR_NOT_TAKEN)
+            return false;
+        return counters[slot(pc)] >= 2;
+    }
+
+    void update(uint16_t pc, bool taken)
+    {
+        uint8_t& counter = counters[slot(pc)];
+        if (taken && counter < 3)
+            counter++;
+        else if (!taken && counter > 0)
+            counter--;
+        history = ((history << 1) | taken) & mask;
+    }
+
+    Predictor kind;
+    vector<uint8_t> counters;
+    uint32_t mask;
+    uint32_t history = 0; // outcomes of the latest jeqs, newest in bit 0
+
+private:
+    size_t slot(uint16_t pc) const { return (kind == PREDICTOR_GSHARE ? pc ^ history : pc) & mask; }
+};
+
+/*
+    Return-address stack for jr: jal pushes its return address and jr
+    predicts the top. When full, a push overwrites the oldest entry, so
+    deep recursion only loses the outermost returns.
+*/
+struct ReturnAddressStack
+{
+    ReturnAddressStack(size_t size) : entries(size) {}
+
+    void push(uint16_t address)
+    {
+        if (entries.empty())
+            return;
+        top = (top + 1) % entries.size();
+        entries[top] = address;
+        depth = min(depth + 1, entries.size());
+    }
+
+    // @return false if the stack is empty, so there is no prediction
+    bool pop(uint16_t& address)
+    {
+        if (depth == 0)
+            return false;
+        address = entries[top];
+        top = (top + entries.size() - 1) % entries.size();
+        depth--;
+        return true;
+    }
+
+    vector<uint16_t> entries;
+    size_t top = 0;
+    size_t depth = 0; // valid entries
+};
+
+// What held back fetch or dispatch, for the stall breakdown
+enum Stall { STALL_MISPREDICT, STALL_JR, STALL_ROB, STALL_IQ, STALL_PRF, STALL_LSQ, NUM_STALLS };
+const char* const stall_names[NUM_STALLS] = {"jeq mispredict", "jr mispredict", "ROB full", "IQ full", "PRF full", "LSQ full"};
+
+/*
+    One-pass out-of-order timing model. The reference interpreter executes
+    each instruction, then place() puts it in time, in program order:
+    fetch and dispatch in order at the configured width, issue once its
+    operands are ready and an issue slot is free, commit in order. An
+    instruction dispatches only once the ROB, issue queue, load/store
+    queue and physical register file have room, which the commit (or,
+    for the issue queue, issue) cycles of older instructions decide.
+    A physical register is held from the writer's dispatch to its commit,
+    when the mapping it replaced is freed. Loads take their latency from
+    cache_func() at the cycle they issue, unless an uncommitted older
+    store to the same word forwards the data; memory disambiguation is
+    perfect. jeq is predicted by the direction predictor and jr by the
+    return-address stack; a mispredict refetches after it resolves.
+*/
+struct OutOfOrderCore
+{
+    OutOfOrderCore(const CoreConfig& config) : config(config), predictor(config.predictor, config.predictor_bits), return_stack(config.ras_size),
+        store_ready(MEM_SIZE, 0), store_commit(MEM_SIZE, 0), stalls(NUM_STALLS, 0),
+        rob_histogram(config.rob_size + 1, 0), iq_histogram(config.iq_size + 1, 0), lsq_histogram(config.lsq_size + 1, 0)
+    {
+        fill(reg_ready, reg_ready + NUM_REGS, 0);
+    }
+
+    /*
+        @param next_pc Where execution went after the instruction
+        @param address For a lw or sw, the word it accessed
+    */
+    void place(const Decoded& d, uint16_t pc, uint16_t next_pc, uint16_t address, Cache& a_cache, vector<int>& parts)
+    {
+        bool is_mem = d.op == OP_LW || d.op == OP_SW;
+        Operands operands = operands_of(d);
+        int dest = operands.dest; // writes to $0 need no physical register
+
+        // fetch, which stalls while dispatch does: it runs at most depth cycles ahead
+        if (fetched == config.fetch_width)
+        {
+            fetch_cycle++;
+            fetched = 0;
+        }
+        if (fetch_cycle + config.depth < last_dispatch)
+        {
+            fetch_cycle = last_dispatch - config.depth;
+            fetched = 0;
+        }
+        uint64_t fetch = fetch_cycle;
+        fetched++;
+
+        // dispatch, in order, once there is room for the instruction
+        uint64_t dispatch = max(fetch + config.depth, last_dispatch);
+        if (dispatch == last_dispatch && dispatched == config.fetch_width)
+            dispatch++;
+        uint64_t unstalled = dispatch;
+        int cause = -1;
+        auto wait_for = [&](uint64_t cycle, Stall why) {
+            if (cycle > dispatch)
+            {
+                dispatch = cycle;
+                cause = why;
+            }
+        };
+        if (rob.size() == config.rob_size)
+        {
+            wait_for(rob.front(), STALL_ROB);
+            rob.pop_front();
+        }
+        if (is_mem && lsq.size() == config.lsq_size)
+        {
+            wait_for(lsq.front(), STALL_LSQ);
+            lsq.pop_front();
+        }
+        if (dest > 0 && renamed.size() == config.prf_size - NUM_REGS)
+        {
+            wait_for(renamed.front(), STALL_PRF);
+            renamed.pop_front();
+        }
+        while (!iq.empty() && iq.top() <= dispatch)
+            iq.pop();
+        if (iq.size() == config.iq_size)
+        {
+            wait_for(iq.top(), STALL_IQ);
+            while (!iq.empty() && iq.top() <= dispatch)
+                iq.pop();
+        }
+        if (cause >= 0)
+            stalls[cause] += dispatch - unstalled;
+        if (dispatch != last_dispatch)
+        {
+            last_dispatch = dispatch;
+            dispatched = 0;
+        }
+        dispatched++;
+
+        // occupancy, weighted by the cycles since the previous sample
+        uint64_t weight = dispatch - sampled;
+        sampled = dispatch;
+        rob_histogram[rob.end() - upper_bound(rob.begin(), rob.end(), dispatch)] += weight;
+        lsq_histogram[lsq.end() - upper_bound(lsq.begin(), lsq.end(), dispatch)] += weight;
+        iq_histogram[iq.size()] += weight;
+
+        // issue at the first cycle with the operands ready and a free slot
+        uint64_t issue = dispatch + 1;
+        for (int i = 0; i < 2; i++)
+        {
+            if (operands.sources[i] >= 0)
+                issue = max(issue, reg_ready[operands.sources[i]]);
+        }
+        issue_slots.erase(issue_slots.begin(), issue_slots.lower_bound(dispatch)); // nothing issues before it dispatches
+        while (issue_slots[issue] == config.issue_width)
+            issue++;
+        issue_slots[issue]++;
+        iq.push(issue);
+
+        // execute
+        uint64_t latency = 1;
+        if (d.op == OP_LW)
+        {
+            loads++;
+            if (store_commit[address] > issue)
+            {
+                forwarded++;
+                latency = max(store_ready[address], issue + 1) - issue;
+            }
+            else
+                latency = cache_func(address, pc, a_cache, parts, false, issue);
+            load_latency += latency;
+        }
+        else if (d.op == OP_SW)
+            cache_func(address, pc, a_cache, parts, true, issue);
+        uint64_t complete = issue + latency;
+        if (dest > 0)
+            reg_ready[dest] = complete;
+
+        // commit, in order
+        uint64_t commit = max(complete + 1, last_commit);
+        if (commit == last_commit && committed == config.commit_width)
+            commit++;
+        if (commit != last_commit)
+        {
+            last_commit = commit;
+            committed = 0;
+        }
+        committed++;
+        rob.push_back(commit);
+        if (is_mem)
+            lsq.push_back(commit);
+        if (dest > 0)
+            renamed.push_back(commit);
+        if (d.op == OP_SW)
+        {
+            store_ready[address] = complete;
+            store_commit[address] = commit;
+        }
+        instructions++;
+
+        // where fetch goes next
+        if (d.op == OP_JEQ)
+        {
+            bool taken = next_pc != (uint16_t)(pc + 1);
+            predictions++;
+            bool guess = predictor.predict(pc);
+            predictor.update(pc, taken);
+            if (guess != taken)
+            {
+                mispredicts++;
+                redirect(fetch, complete + 1, STALL_MISPREDICT);
+            }
+            else if (taken)
+                fetched = config.fetch_width; // a taken branch ends the fetch group
+        }
+        else if (d.op == OP_JR)
+        {
+            uint16_t guess;
+            return_predictions++;
+            if (return_stack.pop(guess) && guess == next_pc)
+                fetched = config.fetch_width;
+            else
+            {
+                return_mispredicts++;
+                redirect(fetch, complete + 1, STALL_JR);
+            }
+        }
+        else if (d.op == OP_J || d.op == OP_JAL)
+        {
+            if (d.op == OP_JAL)
+                return_stack.push(pc + 1);
+            fetched = config.fetch_width;
+        }
+    }
+
+    /*
+        Trains the branch predictor and return-address stack on an
+        instruction outside the timed units of --smarts, without timing it.
+    */
+    void warm(const Decoded& d, uint16_t pc, uint16_t next_pc)
+    {
+        uint16_t guess;
+        if (d.op == OP_JEQ)
+            predictor.update(pc, next_pc != (uint16_t)(pc + 1));
+        else if (d.op == OP_JR)
+            return_stack.pop(guess);
+        else if (d.op == OP_JAL)
+            return_stack.push(pc + 1);
+    }
+
+    /*
+        Formats the share of predictions that were right as a percentage, or
+        n/a when nothing was predicted.
+    */
+    static string accuracy(uint64_t predictions, uint64_t mispredicts)
+    {
+        if (predictions == 0)
+            return "n/a";
+        ostringstream text;
+        text << 100.0 * (predictions - mispredicts) / predictions << "%";
+        return text.str();
+    }
+
+    void report() const
+    {
+        cout << "Out-of-order core: fetch " << config.fetch_width << ", issue " << config.issue_width << ", commit " << config.commit_width <<
+            ", ROB " << config.rob_size << ", IQ " << config.iq_size << ", PRF " << config.prf_size << ", LSQ " << config.lsq_size <<
+            ", depth " << config.depth << ", " << predictor_name(config.predictor) << " predictor";
+        if (config.predictor == PREDICTOR_BIMODAL || config.predictor == PREDICTOR_GSHARE)
+            cout << " (" << predictor.counters.size() << " counters)";
+        cout << endl;
+        cout << "instructions " << instructions << ", cycles " << last_commit << ", CPI " << (instructions == 0 ? 0.0 : (double)last_commit / instructions) <<
+            ", IPC " << (last_commit == 0 ? 0.0 : (double)instructions / last_commit) << endl;
+        cout << "jeq predictions " << predictions << ", mispredictions " << mispredicts << " (accuracy " <<
+            accuracy(predictions, mispredicts) << ")" << endl;
+        cout << "jr predictions " << return_predictions << ", mispredictions " << return_mispredicts << " (accuracy " <<
+            accuracy(return_predictions, return_mispredicts) << ", " << config.ras_size << "-entry return-address stack)" << endl;
+        cout << "loads " << loads << ", forwarded from stores " << forwarded << ", average latency " <<
+            (loads == 0 ? 0.0 : (double)load_latency / loads) << " cycles" << endl;
+        cout << "stall cycles:";
+        for (int i = 0; i < NUM_STALLS; i++)
+            cout << (i == 0 ? " " : ", ") << stall_names[i] << " " << stalls[i];
+        cout << endl;
+        print_histogram("ROB", rob_histogram);
+        print_histogram("IQ", iq_histogram);
+        print_histogram("LSQ", lsq_histogram);
+    }
+
+    CoreConfig config;
+    BranchPredictor predictor;
+    ReturnAddressStack return_stack;
+    uint64_t reg_ready[NUM_REGS]; // cycle each register's latest value is available
+    vector<uint64_t> store_ready; // per word, when the latest store's data is available
+    vector<uint64_t> store_commit; // per word, when the latest store leaves the LSQ
+    deque<uint64_t> rob; // commit cycles of the instructions that may still hold a ROB entry, oldest first
+    deque<uint64_t> lsq; // likewise for the lw and sw
+    deque<uint64_t> renamed; // likewise for the register writers
+    priority_queue<uint64_t, vector<uint64_t>, greater<uint64_t>> iq; // issue cycles of the instructions that may still wait to issue
+    map<uint64_t, size_t> issue_slots; // instructions issued per cycle, from the latest dispatch on
+
+    uint64_t fetch_cycle = 0;
+    size_t fetched = 0; // in fetch_cycle
+    uint64_t last_dispatch = 0;
+    size_t dispatched = 0; // in last_dispatch
+    uint64_t last_commit = 0;
+    size_t committed = 0; // in last_commit
+    uint64_t sampled = 0; // cycle of the latest occupancy sample
+
+    uint64_t instructions = 0;
+    uint64_t predictions = 0;
+    uint64_t mispredicts = 0;
+    uint64_t return_predictions = 0; // jr
+    uint64_t return_mispredicts = 0;
+    uint64_t loads = 0;
+    uint64_t forwarded = 0;
+    uint64_t load_latency = 0;
+    vector<uint64_t> stalls; // cycles per Stall cause
+    vector<uint64_t> rob_histogram; // cycles spent at each occupancy
+    vector<uint64_t> iq_histogram;
+    vector<uint64_t> lsq_histogram;
+
+private:
+    // Fetch resumes at cycle, not at the cycle after fetch
+    void redirect(uint64_t fetch, uint64_t cycle, Stall why)
+    {
+        stalls[why] += cycle - fetch - 1;
+        fetch_cycle = cycle;
+        fetched = 0;
+    }
+
+    // Prints the share of cycles in each eighth of a structure's capacity
+    static void print_histogram(const string& name, const vector<uint64_t>& histogram)
+    {
+        uint64_t total = 0;
+        uint64_t weighted = 0;
+        for (size_t i = 0; i < histogram.size(); i++)
+        {
+            total += histogram[i];
+            weighted += i * histogram[i];
+        }
+        size_t capacity = histogram.size() - 1;
+        size_t buckets = min((size_t)8, capacity + 1);
+        cout << name << " occupancy: average " << (total == 0 ? 0.0 : (double)weighted / total) << " of " << capacity << ";";
+        for (size_t b = 0; b < buckets; b++)
+        {
+            size_t low = b * (capacity + 1) / buckets;
+            size_t high = (b + 1) * (capacity + 1) / buckets; // exclusive
+            uint64_t cycles = 0;
+            for (size_t i = low; i < high; i++)
+                cycles += histogram[i];
+            cout << " " << low;
+            if (high - 1 > low)
+                cout << "-" << high - 1;
+            cout << ": " << (total == 0 ? 0.0 : 100.0 * cycles / total) << "%";
+        }
+        cout << endl;
+    }
+};
+
+/*
+    Sets the cache's level and memory latencies from config, and puts its
+    DRAM on the core's clock.
+*/
+void use_core_latencies(const CoreConfig& config, Cache& a_cache)
+{
+    a_cache.log_accesses = false;
+    a_cache.levels_vec[0].latency = config.l1_latency;
+    if (a_cache.levels_vec.size() == 2)
+        a_cache.levels_vec[1].latency = config.l2_latency;
+    a_cache.memory_latency = config.memory_latency;
+    for (size_t i = 0; i < a_cache.dram.size(); i++)
+        a_cache.dram[i].now_is_cycle = true;
+}
+
+/*
+    Runs the program on the reference interpreter, timing it with the
+    out-of-order model, then prints the model's report.
+
+    @param a_cache The cache as configured; its level latencies are set
+        from config
+    @param state As for run_e20_simulator(); memory_arr is updated with it.
+        An undefined instruction the policy skips or traps on is timed as
+        a nop.
+    @param analysis Fed every lw and sw in program order, as the in-order
+        run feeds it
+    @return The number of instructions executed
+*/
+size_t run_out_of_order(const CoreConfig& config, Cache& a_cache, vector<int>& parts, MachineState& state, uint16_t memory_arr[], Analysis& analysis)
+{
+    use_core_latencies(config, a_cache);
+
+    vector<Machine> machines(1);
+    Machine& machine = machines[0];
+    machine.reset();
+    static_cast<MachineState&>(machine) = state;
+    copy(memory_arr, memory_arr + MEM_SIZE, machine.memory_arr);
+    OutOfOrderCore core(config);
+    Status status = STATUS_RUNNING;
+    while (status == STATUS_RUNNING)
+    {
+        uint16_t pc = machine.pc % MEM_SIZE;
+        Decoded d = decode(machine.memory_arr[pc]);
+        uint16_t address = (machine.regs_arr[d.reg_a] + d.imm) % MEM_SIZE;
+        status = step_e20(machine);
+        if (status == STATUS_ILLEGAL)
+            break;
+        if (status == STATUS_RUNNING && machine.executed % MEM_SIZE == 0)
+            status = poll_limits(machine, machine.executed); // as run_e20_simulator() does for wrapping code
+        if (d.op == OP_LW || d.op == OP_SW)
+            record_access(analysis, address, d.op == OP_SW);
+        core.place(d, pc, machine.pc, address, a_cache, parts);
+    }
+    core.report();
+    machine.status = status;
+    size_t steps = machine.executed - state.executed;
+    state = machine;
+    copy(machine.memory_arr, machine.memory_arr + MEM_SIZE, memory_arr);
+    return steps;
+}
+
+/*
+    The --smarts run loop for --ooo: like run_e20_simulator() with
+    sampling, but the detailed units are timed on core, which records each
+    one's cycles through sampling.clock, while the instructions between
+    them only warm the cache tags, the branch predictor and the
+    return-address stack.
+
+    @param state As for run_out_of_order()
+    @return The number of instructions executed
+*/
+size_t run_timed_units(OutOfOrderCore& core, MachineState& state, uint16_t memory_arr[], Cache& a_cache, vector<int>& parts, Sampling& sampling)
+{
+    vector<Machine> machines(1);
+    Machine& machine = machines[0];
+    machine.reset();
+    static_cast<MachineState&>(machine) = state;
+    copy(memory_arr, memory_arr + MEM_SIZE, machine.memory_arr);
+    sampling.clock = &core.last_commit;
+    Status status = STATUS_RUNNING;
+    while (status == STATUS_RUNNING)
+    {
+        if (sampling.left == 0)
+            next_interval(sampling, a_cache);
+        sampling.left--;
+        uint16_t pc = machine.pc % MEM_SIZE;
+        Decoded d = decode(machine.memory_arr[pc]);
+        uint16_t address = (machine.regs_arr[d.reg_a] + d.imm) % MEM_SIZE;
+        status = step_e20(machine);
+        if (status == STATUS_ILLEGAL)
+            break;
+        if (status == STATUS_RUNNING && machine.executed % MEM_SIZE == 0)
+            status = poll_limits(machine, machine.executed);
+        if (sampling.detailed)
+            core.place(d, pc, machine.pc, address, a_cache, parts);
+        else
+        {
+            core.warm(d, pc, machine.pc);
+            if (d.op == OP_LW || d.op == OP_SW)
+                cache_func(address, pc, a_cache, parts, d.op == OP_SW, core.last_commit); // functional warming; only the tags matter
+        }
+    }
+    next_interval(sampling, a_cache); // close the last interval
+    machine.status = status;
+    size_t steps = machine.executed - state.executed;
+    state = machine;
+    copy(machine.memory_arr, machine.memory_arr + MEM_SIZE, memory_arr);
+    return steps;
+}
+
+/*
+    Runs the program with SMARTS sampling: a detailed unit every period,
+    the cache tags kept warm in between. Unless the period is given, it
+    starts sparse and, while some level's miss rate (or, with a core,
+    the CPI) is less precise than the target, reruns with the period the
+    measured variance calls for.
+
+    @param cold_cache The cache as configured, before any access
+    @param state The state to start every attempt from; updated to the
+        final attempt's, with memory_arr, so a stop can be reported
+    @param core_config With --ooo, the core that times the detailed units;
+        otherwise nullptr
+    @return The number of instructions in the program
+*/
+size_t run_smarts(const Smarts& smarts, const Cache& cold_cache, MachineState& state, uint16_t memory_arr[], vector<int>& parts, const CoreConfig* core_config)
+{
+    uint64_t period = smarts.period != 0 ? max((uint64_t)1, smarts.period / smarts.unit) : 1000; // in units
+    vector<uint16_t> memory(MEM_SIZE);
+    for (int attempt = 1; ; attempt++)
+    {
+        MachineState run = state;
+        copy(memory_arr, memory_arr + MEM_SIZE, memory.begin());
+        Cache a_cache = cold_cache;
+        a_cache.log_accesses = false;
+        Analysis analysis;
+        Sampling sampling;
+        sampling.interval = smarts.unit;
+        sampling.period = period;
+        sampling.warm_between = true;
+        size_t steps;
+        if (core_config != nullptr)
+        {
+            use_core_latencies(*core_config, a_cache);
+            OutOfOrderCore core(*core_config);
+            steps = run_timed_units(core, run, memory.data(), a_cache, parts, sampling);
+        }
+        else
+            steps = run_e20_simulator(run, memory.data(), a_cache, parts, analysis, sampling);
+
+        double population = (steps + smarts.unit - 1) / smarts.unit;
+        size_t num_levels = a_cache.levels_vec.size();
+        vector<RatioEstimate> miss_rates(num_levels);
+        vector<RatioEstimate> mpki(num_levels); // misses per 1000 instructions
+        double needed = 0; // units the least precise level needs to reach the target
+        uint64_t detailed = 0;
+        for (size_t level = 0; level < num_levels; level++)
+        {
+            vector<double> misses, accesses, instructions;
+            for (size_t i = 0; i < sampling.stats.size(); i++)
+            {
+                misses.push_back(sampling.stats[i].levels[level].misses);
+                accesses.push_back(sampling.stats[i].levels[level].hits + sampling.stats[i].levels[level].misses);
+                instructions.push_back(sampling.stats[i].instructions / 1000.0);
+            }
+            miss_rates[level] = estimate_ratio(misses, accesses, population);
+            mpki[level] = estimate_ratio(misses, instructions, population);
+            if (miss_rates[level].ratio > 0)
+            {
+                double relative = miss_rates[level].half_width / miss_rates[level].ratio;
+                needed = max(needed, sampling.stats.size() * (relative / smarts.target_error) * (relative / smarts.target_error));
+            }
+        }
+        for (size_t i = 0; i < sampling.stats.size(); i++)
+            detailed += sampling.stats[i].instructions;
+        RatioEstimate cpi;
+        if (core_config != nullptr)
+        {
+            vector<double> cycles, instructions;
+            for (size_t i = 0; i < sampling.stats.size(); i++)
+            {
+                cycles.push_back(sampling.stats[i].cycles);
+                instructions.push_back(sampling.stats[i].instructions);
+            }
+            cpi = estimate_ratio(cycles, instructions, population);
+            if (cpi.ratio > 0)
+            {
+                double relative = cpi.half_width / cpi.ratio;
+                needed = max(needed, sampling.stats.size() * (relative / smarts.target_error) * (relative / smarts.target_error));
+            }
+        }
+
+        // the sample variance is unreliable from a handful of units, so insist on at least 30
+        uint64_t wanted = max(needed, 30.0);
+        uint64_t next_period = max((uint64_t)1, (uint64_t)(population / wanted));
+        // a run that stopped short of halting would only stop there again
+        if (run.status != STATUS_HALTED || smarts.period != 0 || sampling.stats.size() >= wanted || next_period >= period || attempt == 5)
+        {
+            cout << "SMARTS: " << sampling.stats.size() << " units of " << smarts.unit << " instructions, one every " << period * smarts.unit <<
+                " instructions (" << detailed << " of " << steps << " instructions in detail)" << endl;
+            for (size_t level = 0; level < num_levels; level++)
+            {
+                cout << "L" << level + 1 << " miss rate " << miss_rates[level].ratio << " +- " << miss_rates[level].half_width <<
+                    ", misses per 1000 instructions " << mpki[level].ratio << " +- " << mpki[level].half_width << " (95% confidence)" << endl;
+            }
+            if (core_config != nullptr)
+                cout << "CPI " << cpi.ratio << " +- " << cpi.half_width << " (95% confidence)" << endl;
+            state = run;
+            copy(memory.begin(), memory.end(), memory_arr);
+            return steps;
+        }
+        period = next_period;
+    }
+}
+
+/*
+    Dataflow limit study for one window size. Every instruction takes one
+    cycle and waits only for its true dependences: the registers it reads
+    and, for a lw, the latest sw to its word. Renaming, branch prediction
+    and memory disambiguation are perfect. With a window, instruction i
+    cannot start before instruction i - window has retired, retirement
+    being in order. Only ready times are kept (per register, per memory
+    word and for the last window retirements), so memory stays O(window)
+    however long the run.
+*/
+struct DataflowLimit
+{
+    DataflowLimit(size_t window) : window(window), retired(window, 0), word_ready(MEM_SIZE, 0)
+    {
+        fill(reg_ready, reg_ready + NUM_REGS, 0);
+    }
+
+    void place(const Decoded& d, uint16_t address)
+    {
+        uint64_t start = window == 0 ? 0 : retired[instructions % window]; // retirement of instruction i - window
+        Operands operands = operands_of(d);
+        for (int i = 0; i < 2; i++)
+        {
+            if (operands.sources[i] >= 0)
+                start = max(start, reg_ready[operands.sources[i]]);
+        }
+        if (d.op == OP_LW)
+            start = max(start, word_ready[address]);
+        uint64_t done = start + 1;
+        if (operands.dest >= 0)
+            reg_ready[operands.dest] = done;
+        if (d.op == OP_SW)
+            word_ready[address] = done;
+        critical_path = max(critical_path, done);
+        if (window != 0)
+        {
+            last_retired = max(last_retired, done);
+            retired[instructions % window] = last_retired;
+        }
+        instructions++;
+    }
+
+    size_t window; // 0 for unlimited
+    vector<uint64_t> retired; // retirement cycles of the last window instructions, a ring indexed by instruction count
+    vector<uint64_t> word_ready; // per memory word, cycle its latest sw completes
+    uint64_t reg_ready[NUM_REGS]; // per register, cycle its latest value is produced
+    uint64_t last_retired = 0;
+    uint64_t critical_path = 0; // cycles to complete every instruction so far
+    uint64_t instructions = 0;
+};
+
+/*
+    Runs the program on the reference interpreter, feeding every window
+    size's dataflow limit study, and prints each critical path and the
+    ILP it allows, unlimited window first.
+
+    @param state As for run_out_of_order()
+    @return The number of instructions executed
+*/
+size_t run_dataflow_limits(const vector<size_t>& windows, MachineState& state, uint16_t memory_arr[])
+{
+    vector<DataflowLimit> limits(1, DataflowLimit(0));
+    for (size_t i = 0; i < windows.size(); i++)
+        limits.push_back(DataflowLimit(windows[i]));
+
+    vector<Machine> machines(1);
+    Machine& machine = machines[0];
+    machine.reset();
+    static_cast<MachineState&>(machine) = state;
+    copy(memory_arr, memory_arr + MEM_SIZE, machine.memory_arr);
+    Status status = STATUS_RUNNING;
+    while (status == STATUS_RUNNING)
+    {
+        uint16_t pc = machine.pc % MEM_SIZE;
+        Decoded d = decode(machine.memory_arr[pc]);
+        uint16_t address = (machine.regs_arr[d.reg_a] + d.imm) % MEM_SIZE;
+        status = step_e20(machine);
+        if (status == STATUS_ILLEGAL)
+            break;
+        if (status == STATUS_RUNNING && machine.executed % MEM_SIZE == 0)
+            status = poll_limits(machine, machine.executed); // as run_e20_simulator() does for wrapping code
+        for (size_t i = 0; i < limits.size(); i++)
+            limits[i].place(d, address);
+    }
+    machine.status = status;
+    size_t steps = machine.executed - state.executed;
+    state = machine;
+    copy(machine.memory_arr, machine.memory_arr + MEM_SIZE, memory_arr);
+
+    cout << "Dataflow limit over " << limits[0].instructions << " instructions (unit latency, perfect renaming and prediction)" << endl;
+    for (size_t i = 0; i < limits.size(); i++)
+    {
+        const DataflowLimit& limit = limits[i];
+        cout << "window ";
+        if (limit.window == 0)
+            cout << "unlimited";
+        else
+            cout << limit.window;
+        cout << ": critical path " << limit.critical_path << " cycles, ILP " <<
+            (limit.critical_path == 0 ? 0.0 : (double)limit.instructions / limit.critical_path) << endl;
+    }
+    return steps;
+}
+
+/*
+    Runs the simulator in the chosen mode: SMARTS sampling (timed on the
+    out-of-order core if one is given), the out-of-order core, or the cache
+    model after any fast-forward.
+
+    @return The number of instructions the program ran
+*/
+size_t run_mode(const Smarts& smarts, const CoreConfig* core_config, const FastForward& ff, MachineState& state, uint16_t* memory_arr, Cache& a_cache, vector<int>& parts, Analysis& analysis, Sampling& sampling) {
+    if (smarts.unit != 0)
+        return run_smarts(smarts, a_cache, state, memory_arr, parts, core_config);
+    if (core_config != nullptr)
+        return run_out_of_order(*core_config, a_cache, parts, state, memory_arr, analysis);
+    return run_fast_forward(ff, state, memory_arr, a_cache, parts, analysis, sampling);
+}
+
+/*
+    Runs the simulator, wrapped in host performance counters when requested.
+    Under SMARTS, the counters also cover any reruns that pick the period.
+*/
+size_t run_with_host_perf(bool host_perf, const Smarts& smarts, const CoreConfig* core_config, const FastForward& ff, MachineState& state, uint16_t* memory_arr, Cache& a_cache, vector<int>& parts, Analysis& analysis, Sampling& sampling) {
+    if (host_perf)
+    {
+        HostPerf perf;
+        perf.start();
+        size_t steps = run_mode(smarts, core_config, ff, state, memory_arr, a_cache, parts, analysis, sampling);
+        perf.stop();
+        perf.report(steps);
+        return steps;
+    }
+    return run_mode(smarts, core_config, ff, state, memory_arr, a_cache, parts, analysis, sampling);
+}
+
+/*
+    Reports a run that stopped other than by halting, as e20_sim does; a
+    step limit or timeout is followed by the partial state, after the
+    output the run got to print.
+
+    @return The exit status: 0 for a halt (or no run), 1 for an illegal
+        instruction, 2 for a step limit or timeout
+*/
+int stop_exit_code(const MachineState& state, const uint16_t memory_arr[])
+{
+    if (state.status == STATUS_RUNNING || state.status == STATUS_HALTED)
+        return 0;
+    report_stop(state, memory_arr[state.pc % MEM_SIZE], cerr);
+    if (state.status == STATUS_ILLEGAL)
+        return 1;
+    print_state(state.pc, state.regs_arr, memory_arr, 128, cout);
+    return 2;
+}
+
+/**
     Main function
     Takes command-line args as documented below
 */
@@ -473,6 +2593,24 @@ int main(int argc, char *argv[]) {
     bool do_help = false;
     bool arg_error = false;
     string cache_config;
+    bool host_perf = false;
+    string heatmap_prefix;
+    string reuse_prefix;
+    string result_cache_dir;
+    uint64_t ws_window = 1024;
+    MachineState state; // the pc and registers, the illegal-instruction policy and the step limit
+    state.reset_state();
+    double timeout = 0; // seconds; 0 for none
+    string bbv_prefix;
+    string simpoints_prefix;
+    uint64_t interval = 10000;
+    size_t max_k = 10;
+    FastForward fast_forward;
+    Smarts smarts;
+    bool out_of_order = false;
+    CoreConfig core_config;
+    vector<size_t> ilp_windows;
+    bool ilp_study = false;
     for (int i=1; i<argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-",0)==0) {
@@ -485,6 +2623,135 @@ int main(int argc, char *argv[]) {
                 else
                     cache_config = argv[i];
             }
+            else if (arg == "--host-perf")
+                host_perf = true;
+            else if (arg == "--illegal") {
+                i++;
+                if (i>=argc || !parse_illegal_policy(argv[i], state.illegal_policy))
+                    arg_error = true;
+            }
+            else if (arg == "--trap-vector") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], state.trap_vector, 0, REG_SIZE - 1))
+                    arg_error = true;
+            }
+            else if (arg == "--max-steps") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], state.step_limit))
+                    arg_error = true;
+            }
+            else if (arg == "--timeout") {
+                i++;
+                if (i>=argc || !parse_positive(argv[i], timeout))
+                    arg_error = true;
+            }
+            else if (arg == "--heatmap") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    heatmap_prefix = argv[i];
+            }
+            else if (arg == "--result-cache") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    result_cache_dir = argv[i];
+            }
+            else if (arg == "--reuse") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    reuse_prefix = argv[i];
+            }
+            else if (arg == "--bbv") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    bbv_prefix = argv[i];
+            }
+            else if (arg == "--simpoints") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    simpoints_prefix = argv[i];
+            }
+            else if (arg == "--interval") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], interval, 1))
+                    arg_error = true;
+            }
+            else if (arg == "--max-k") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], max_k, 1))
+                    arg_error = true;
+            }
+            else if (arg == "--fast-forward") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], fast_forward.instructions))
+                    arg_error = true;
+            }
+            else if (arg == "--fast-forward-pc") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], fast_forward.stop_pc, 0, REG_SIZE - 1))
+                    arg_error = true;
+            }
+            else if (arg == "--warming") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], fast_forward.warming))
+                    arg_error = true;
+            }
+            else if (arg == "--smarts") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], smarts.unit, 1))
+                    arg_error = true;
+            }
+            else if (arg == "--smarts-period") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], smarts.period, 1))
+                    arg_error = true;
+            }
+            else if (arg == "--target-error") {
+                i++;
+                if (i>=argc || !parse_positive(argv[i], smarts.target_error))
+                    arg_error = true;
+            }
+            else if (arg == "--ooo") {
+                i++;
+                if (i>=argc || !parse_core_config(argv[i], core_config))
+                    arg_error = true;
+                else
+                    out_of_order = true;
+            }
+            else if (arg == "--ilp") {
+                i++;
+                ilp_study = true;
+                string windows = i < argc ? argv[i] : "";
+                size_t start = 0;
+                while (true)
+                {
+                    size_t comma = windows.find(',', start);
+                    string field = windows.substr(start, comma == string::npos ? string::npos : comma - start);
+                    if (field.empty() || field.find_first_not_of("0123456789") != string::npos || field.size() > 9 || stoul(field) == 0)
+                    {
+                        arg_error = true;
+                        break;
+                    }
+                    ilp_windows.push_back(stoul(field));
+                    if (comma == string::npos)
+                        break;
+                    start = comma + 1;
+                }
+            }
+            else if (arg == "--ws-window") {
+                i++;
+                if (i>=argc || !parse_number(argv[i], ws_window, 1))
+                    arg_error = true;
+            }
             else
                 arg_error = true;
         } else {
@@ -495,8 +2762,20 @@ int main(int argc, char *argv[]) {
         }
     }
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] filename" << endl << endl;
+    int sampling_modes = !bbv_prefix.empty() + !simpoints_prefix.empty() + (smarts.unit != 0);
+    bool fast_forwarded = fast_forward.instructions > 0 || fast_forward.stop_pc >= 0 || fast_forward.warming > 0;
+    // everything but --bbv and --ilp simulates the cache, so does nothing without one
+    bool needs_cache = !simpoints_prefix.empty() || smarts.unit != 0 || out_of_order || !heatmap_prefix.empty() || !reuse_prefix.empty() || fast_forwarded || host_perf;
+    // --smarts simulates its units on a cache and analysis of its own, and --bbv and --ilp on none
+    bool analysis_unfed = (!heatmap_prefix.empty() || !reuse_prefix.empty()) && (smarts.unit != 0 || !bbv_prefix.empty() || ilp_study);
+    if (arg_error || do_help || filename == nullptr || sampling_modes + (out_of_order && smarts.unit == 0) + ilp_study > 1 || ((sampling_modes > 0 || out_of_order || ilp_study) && fast_forwarded) || (needs_cache && cache_config.empty()) || analysis_unfed) {
+        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] [--host-perf] [--heatmap PREFIX]" << endl;
+        cerr << "       [--illegal POLICY] [--trap-vector ADDR] [--max-steps N] [--timeout SEC]" << endl;
+        cerr << "       [--reuse PREFIX] [--ws-window N] [--result-cache DIR]" << endl;
+        cerr << "       [--fast-forward N | --fast-forward-pc PC] [--warming N]" << endl;
+        cerr << "       [--bbv PREFIX | --simpoints PREFIX] [--interval N] [--max-k K]" << endl;
+        cerr << "       [--smarts U] [--smarts-period K] [--target-error E]" << endl;
+        cerr << "       [--ooo CORE | --ilp WINDOWS] filename" << endl << endl;
         cerr << "Simulate E20 cache" << endl << endl;
         cerr << "positional arguments:" << endl;
         cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
@@ -505,7 +2784,67 @@ int main(int argc, char *argv[]) {
         cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one"<<endl;
         cerr << "                 cache) or"<<endl;
         cerr << "                 size,associativity,blocksize,size,associativity,blocksize"<<endl;
-        cerr << "                 (for two caches)"<<endl;
+        cerr << "                 (for two caches), optionally followed by"<<endl;
+        cerr << "                 :banks,row_words,open|closed,tRCD,tCAS,tRP to model"<<endl;
+        cerr << "                 DRAM behind the last level (any prefix of the fields;"<<endl;
+        cerr << "                 defaults 8,64,open,14,14,14)"<<endl;
+        cerr << "  --host-perf    report host cycles, instructions, branch-misses and"<<endl;
+        cerr << "                 cache-misses per simulated instruction (Linux only)"<<endl;
+        cerr << "  --illegal POLICY  what an undefined opcode 0 function code does: stop"<<endl;
+        cerr << "                 (default; print a diagnostic, exit 1), nop, or trap"<<endl;
+        cerr << "                 (jump to --trap-vector with $7 = pc + 1)"<<endl;
+        cerr << "  --trap-vector ADDR  handler address for --illegal trap (default 0)"<<endl;
+        cerr << "  --max-steps N  stop after about N instructions, at the end of the basic"<<endl;
+        cerr << "                 block that reaches N, with the output so far (exit 2)"<<endl;
+        cerr << "  --timeout SEC  likewise stop once SEC seconds of wall-clock time pass"<<endl;
+        cerr << "  --heatmap PREFIX  write per-word lw/sw counts to PREFIX.mem.csv and"<<endl;
+        cerr << "                 per-row hit/miss/eviction counts to PREFIX.rows.csv"<<endl;
+        cerr << "  --reuse PREFIX  write reuse-distance histograms, predicted fully"<<endl;
+        cerr << "                 associative miss rates and working-set sizes for"<<endl;
+        cerr << "                 blocksizes 1-64 to PREFIX.{reuse,missrate,ws}.csv"<<endl;
+        cerr << "  --ws-window N  accesses per working-set window (default 1024)"<<endl;
+        cerr << "  --result-cache DIR  reuse the output of earlier runs of the same image"<<endl;
+        cerr << "                 and cache config, stored in DIR (ignored with"<<endl;
+        cerr << "                 --host-perf, --heatmap, --reuse, --bbv, --simpoints,"<<endl;
+        cerr << "                 --smarts, --ooo and --ilp)"<<endl;
+        cerr << "  --fast-forward N  run the first N instructions on the fast predecoded"<<endl;
+        cerr << "                 engine with no cache model, then simulate the rest"<<endl;
+        cerr << "  --fast-forward-pc PC  fast-forward until pc first reaches PC instead"<<endl;
+        cerr << "  --warming N    after any fast-forward, run N instructions that update"<<endl;
+        cerr << "                 the cache tags without logging or counting them"<<endl;
+        cerr << "  --bbv PREFIX   run functionally, collecting a basic block vector per"<<endl;
+        cerr << "                 interval, cluster them (k-means, k chosen by BIC) and"<<endl;
+        cerr << "                 write PREFIX.{bb,simpoints,weights}; needs no --cache"<<endl;
+        cerr << "  --simpoints PREFIX  simulate the cache only in the intervals listed in"<<endl;
+        cerr << "                 PREFIX.simpoints and extrapolate whole-program totals"<<endl;
+        cerr << "                 using PREFIX.weights; use the same --interval as --bbv"<<endl;
+        cerr << "  --interval N   instructions per SimPoint interval (default 10000)"<<endl;
+        cerr << "  --max-k K      most clusters --bbv considers (default 10)"<<endl;
+        cerr << "  --smarts U     measure a detailed unit of U instructions periodically,"<<endl;
+        cerr << "                 keeping the cache tags warm in between, and report"<<endl;
+        cerr << "                 miss rates with 95% confidence intervals; with --ooo,"<<endl;
+        cerr << "                 the units are timed on that core and CPI is reported too"<<endl;
+        cerr << "  --smarts-period K  one unit every K instructions (default: chosen, by"<<endl;
+        cerr << "                 rerunning, to meet --target-error)"<<endl;
+        cerr << "  --target-error E  wanted confidence half-width relative to each miss"<<endl;
+        cerr << "                 rate and the CPI (default 0.03)"<<endl;
+        cerr << "  --ooo CORE     time the run on an out-of-order core and report CPI,"<<endl;
+        cerr << "                 occupancy and stalls; CORE is KEY=VALUE,... with keys"<<endl;
+        cerr << "                 width (sets fetch, issue and commit), fetch, issue,"<<endl;
+        cerr << "                 commit, rob, iq, prf, lsq, depth, bp (bimodal, gshare,"<<endl;
+        cerr << "                 taken or not-taken), bp-bits, ras (return-address"<<endl;
+        cerr << "                 stack entries), and l1, l2 and mem latencies (defaults"<<endl;
+        cerr << "                 4,4,4,64,32,64,32,3,bimodal,10,16,2,12,100); with"<<endl;
+        cerr << "                 DRAM, its timing replaces mem; numbers must be at least"<<endl;
+        cerr << "                 1, but ras may be 0 and bp-bits is 0 to 20"<<endl;
+        cerr << "  --ilp WINDOWS  run functionally and report the dataflow critical path"<<endl;
+        cerr << "                 and ILP with an unlimited instruction window and with"<<endl;
+        cerr << "                 each of the comma-separated window sizes; needs no --cache"<<endl;
+        cerr << "                 (--bbv, --simpoints, --smarts, --ooo and --ilp exclude each"<<endl;
+        cerr << "                 other, but for --smarts with --ooo, and --fast-forward,"<<endl;
+        cerr << "                 --fast-forward-pc and --warming)"<<endl;
+        cerr << "                 (all but --bbv and --ilp need --cache; --heatmap and --reuse"<<endl;
+        cerr << "                 do not go with --bbv, --smarts or --ilp)"<<endl;
         return 1;
     }
 
@@ -515,15 +2854,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Initialize pc, registers, and memory here, in main()
+    // Initialize memory here, in main(); state already holds pc and registers at 0
     // Load f and parse using load_machine_code
-    uint16_t pc = 0; // initializes pc to 0
-    uint16_t regs_arr[NUM_REGS]; //create an array called regs_arr of size 8 (index 0 to index 7), each index can hold a unsigned 16-bit integer
-    for (size_t i = 0; i < NUM_REGS; i++) //loop over each element in the array
-    {
-        regs_arr[i] = 0; // initializes all registers to 0
-    }
-
     uint16_t memory_arr[MEM_SIZE]; // create an array called memory_arr of size 8192 (index 0 to index 8191), each index can hold a unsigned 16-bit integer
     for (size_t i = 0; i < MEM_SIZE; i++) // loop over each element in the array
     {
@@ -531,18 +2863,112 @@ int main(int argc, char *argv[]) {
     }
 
     // Do simulation.
-    load_machine_code(f, memory_arr);
+    if (!load_machine_code(f, memory_arr))
+    {
+        return 1;
+    }
+    Watchdog watchdog;
+    if (timeout > 0)
+    {
+        state.timeout = &watchdog.expired;
+        watchdog.arm(timeout);
+    }
+
+    if (!bbv_prefix.empty())
+    {
+        if (!write_simpoints(bbv_prefix, interval, max_k, state, memory_arr))
+            return 1;
+        return stop_exit_code(state, memory_arr);
+    }
+    if (ilp_study)
+    {
+        run_dataflow_limits(ilp_windows, state, memory_arr);
+        return stop_exit_code(state, memory_arr);
+    }
+    Sampling sampling;
+    map<uint64_t, double> simpoint_weights;
+    if (!simpoints_prefix.empty())
+    {
+        if (!load_simpoints(simpoints_prefix, sampling, simpoint_weights))
+            return 1;
+        sampling.interval = interval;
+    }
+
+    Analysis analysis;
+    if (!heatmap_prefix.empty())
+    {
+        analysis.word_reads.assign(MEM_SIZE, 0);
+        analysis.word_writes.assign(MEM_SIZE, 0);
+    }
+    if (!reuse_prefix.empty())
+    {
+        for (int blocksize = 1; blocksize <= 64; blocksize *= 2)
+        {
+            analysis.reuse.push_back(ReuseDistance(blocksize));
+            analysis.working_sets.push_back(WorkingSet(blocksize));
+        }
+        analysis.ws_window = ws_window;
+    }
 
     /* parse cache config */
     if (cache_config.size() > 0) {
+        // an optional ":BANKS,ROW_WORDS,..." suffix puts a DRAM model behind the last level
+        bool use_dram = false;
+        DramConfig dram_config;
+        string dram_text;
+        if (cache_config.find(':') != string::npos)
+        {
+            dram_text = cache_config.substr(cache_config.find(':') + 1);
+            cache_config = cache_config.substr(0, cache_config.find(':'));
+            use_dram = true;
+            if (!parse_dram_config(dram_text, dram_config)) {
+                cerr << "Invalid DRAM config" << endl;
+                return 1;
+            }
+        }
         vector<int> parts;
         size_t pos;
         size_t lastpos = 0;
-        while ((pos = cache_config.find(",", lastpos)) != string::npos) {
-            parts.push_back(stoi(cache_config.substr(lastpos,pos)));
+        int part;
+        do {
+            pos = cache_config.find(",", lastpos);
+            if (!parse_number(cache_config.substr(lastpos, pos == string::npos ? string::npos : pos - lastpos), part, 1)) {
+                cerr << "Invalid cache config" << endl;
+                return 1;
+            }
+            parts.push_back(part);
             lastpos = pos + 1;
+        } while (pos != string::npos);
+
+        // The result cache only stands in for the stdout of a plain cache
+        // simulation, so runs that also write analysis files, measure the
+        // host, sample or model an out-of-order core always simulate (--bbv
+        // and --ilp have already returned).
+        ResultCacheKey cache_key;
+        ostringstream captured;
+        streambuf* real_cout = nullptr;
+        size_t steps = 0;
+        if (!result_cache_dir.empty() && !host_perf && heatmap_prefix.empty() && reuse_prefix.empty() && sampling_modes == 0 && !out_of_order && (parts.size() == 3 || parts.size() == 6))
+        {
+            string flags = "cache=";
+            for (size_t i = 0; i < parts.size(); i++)
+                flags += to_string(parts[i]) + ",";
+            if (use_dram)
+                flags += " dram=" + dram_text;
+            if (fast_forwarded)
+                flags += " ff=" + to_string(fast_forward.instructions) + "," + to_string(fast_forward.stop_pc) + "," + to_string(fast_forward.warming);
+            flags += " illegal=" + to_string(state.illegal_policy) + " trap=" + to_string(state.trap_vector);
+            cache_key = result_cache_key(ENGINE_VERSION, memory_arr, flags);
+            string cached_output;
+            // a cached result is a clean halt, which a step limit of at least its length would not have stopped
+            if (result_cache_lookup(result_cache_dir, cache_key, cached_output, steps) && steps <= state.step_limit)
+            {
+                cout << cached_output;
+                return 0;
+            }
+            real_cout = cout.rdbuf(captured.rdbuf());
         }
-        parts.push_back(stoi(cache_config.substr(lastpos)));
+
         if (parts.size() == 3) {
             int L1size = parts[0];
             int L1assoc = parts[1];
@@ -553,10 +2979,19 @@ int main(int argc, char *argv[]) {
             Level l1 = Level(L1size, l1_rows, L1assoc, L1blocksize);
             Cache a_cache; // create a cache
             a_cache.levels_vec.push_back(l1); // push_back L1 cache
+            a_cache.log_accesses = simpoints_prefix.empty();
+            if (use_dram)
+                a_cache.dram.push_back(Dram(dram_config));
 
             print_cache_config("L1", L1size, L1assoc, L1blocksize, l1_rows);
-
-            run_e20_simulator(regs_arr, pc, memory_arr, a_cache, parts); // pass in the register_array, the pc, and the memory array, all of which was initialzied in main()
+            if (use_dram)
+                print_dram_config(dram_config);
+
+            steps = run_with_host_perf(host_perf, smarts, out_of_order ? &core_config : nullptr, fast_forward, state, memory_arr, a_cache, parts, analysis, sampling); // pass in the state and the memory array, both of which were initialized in main()
+            if (smarts.unit == 0)
+                print_dram_stats(a_cache);
+            write_heatmap(heatmap_prefix, a_cache, analysis);
+            write_reuse(reuse_prefix, analysis);
         } else if (parts.size() == 6) {
             int L1size = parts[0];
             int L1assoc = parts[1];
@@ -574,18 +3009,38 @@ int main(int argc, char *argv[]) {
             Cache a_cache; // create a cache
             a_cache.levels_vec.push_back(l1); // push_back L1 cache
             a_cache.levels_vec.push_back(l2); // push_back L2 cache
+            a_cache.log_accesses = simpoints_prefix.empty();
+            if (use_dram)
+                a_cache.dram.push_back(Dram(dram_config));
 
             print_cache_config("L1", L1size, L1assoc, L1blocksize, l1_rows);
             print_cache_config("L2", L2size, L2assoc, L2blocksize, l2_rows);
+            if (use_dram)
+                print_dram_config(dram_config);
 
-            run_e20_simulator(regs_arr, pc, memory_arr, a_cache, parts); // pass in the register_array, the pc, and the memory array, all of which was initialzied in main()
+            steps = run_with_host_perf(host_perf, smarts, out_of_order ? &core_config : nullptr, fast_forward, state, memory_arr, a_cache, parts, analysis, sampling); // pass in the state and the memory array, both of which were initialized in main()
+            if (smarts.unit == 0)
+                print_dram_stats(a_cache);
+            write_heatmap(heatmap_prefix, a_cache, analysis);
+            write_reuse(reuse_prefix, analysis);
 
         } else {
             cerr << "Invalid cache config"  << endl;
             return 1;
         }
+
+        if (!simpoints_prefix.empty())
+            print_simpoint_estimate(sampling, simpoint_weights, steps);
+
+        if (real_cout != nullptr)
+        {
+            cout.rdbuf(real_cout);
+            cout << captured.str();
+            if (state.status == STATUS_HALTED) // a stop's diagnostic is not part of the cached output
+                result_cache_store(result_cache_dir, cache_key, captured.str(), steps);
+        }
     }
 
-    return 0;
+    return stop_exit_code(state, memory_arr);
 }
 